@@ -7,299 +7,5316 @@
 #include <random>
 #include <condition_variable>
 #include <atomic>
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <span>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <streambuf>
+#include <stdexcept>
+#include <system_error>
+#include <tuple>
+#include <coroutine>
+#include <deque>
+#include <limits>
+#include <ctime>
+#include <utility>
+#include <latch>
+#include <bit>
+#include <cmath>
+#include <optional>
+#include <variant>
+#include <source_location>
+#include <functional>
+#include <cstdio>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+constexpr std::size_t kCacheLineSize = 64;
+
+// Bounded lock-free queue (D. Vyukov's sequence-numbered ring). Safe for any number of
+// producers and consumers, which is what lets a producer evict the oldest element itself.
+template<typename T>
+class BoundedQueue {
+    struct alignas(kCacheLineSize) Cell {
+        std::atomic<std::size_t> sequence_;
+        T value_;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    std::size_t mask_;
+    alignas(kCacheLineSize) std::atomic<std::size_t> enqueue_pos_{0};
+    alignas(kCacheLineSize) std::atomic<std::size_t> dequeue_pos_{0};
+
+public:
+    explicit BoundedQueue(std::size_t capacity) {
+        if (capacity > std::size_t{1} << 63) {
+            throw std::length_error("BoundedQueue capacity above 2^63");
+        }
+        std::size_t size = std::bit_ceil(std::max<std::size_t>(capacity, 2));
+        cells_ = std::make_unique<Cell[]>(size);
+        mask_ = size - 1;
+        for (std::size_t i = 0; i < size; ++i) {
+            cells_[i].sequence_.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    std::size_t Capacity() const {
+        return mask_ + 1;
+    }
+
+    bool TryPush(const T &value) {
+        std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells_[pos & mask_];
+            std::size_t sequence = cell.sequence_.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value_ = value;
+                    cell.sequence_.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool TryPop(T &value) {
+        std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells_[pos & mask_];
+            std::size_t sequence = cell.sequence_.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.value_;
+                    cell.sequence_.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Pops up to out.size() values with a single claim of consecutive cells; returns how many.
+    std::size_t TryPopBatch(std::span<T> out) {
+        std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            std::size_t ready = 0;
+            while (ready < out.size() && ready <= mask_) {
+                const Cell &cell = cells_[(pos + ready) & mask_];
+                if (cell.sequence_.load(std::memory_order_acquire) != pos + ready + 1) {
+                    break;
+                }
+                ++ready;
+            }
+            if (ready == 0) {
+                return 0;
+            }
+            // Ready cells cannot be refilled before their consumer releases them, so once the
+            // claim succeeds all `ready` cells are ours.
+            if (dequeue_pos_.compare_exchange_weak(pos, pos + ready, std::memory_order_relaxed)) {
+                for (std::size_t i = 0; i < ready; ++i) {
+                    Cell &cell = cells_[(pos + i) & mask_];
+                    out[i] = cell.value_;
+                    cell.sequence_.store(pos + i + mask_ + 1, std::memory_order_release);
+                }
+                return ready;
+            }
+        }
+    }
+
+    // Approximate: exact only when no push or pop is in flight.
+    std::size_t SizeApprox() const {
+        std::size_t tail = enqueue_pos_.load(std::memory_order_relaxed);
+        std::size_t head = dequeue_pos_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+};
+
+// What an async producer does when the log ring is full.
+enum class OverflowPolicy {
+    kBlock,       // spin until the drain thread makes room
+    kDropNewest,  // discard the record being logged
+    kDropOldest,  // evict the oldest queued record to make room
+};
+
+// Logged values are captured by value; atomics are snapshotted, literals kept as pointers.
+template<typename T>
+struct LogArg {
+    using type = T;
+};
+
+template<typename T>
+struct LogArg<std::atomic<T>> {
+    using type = T;
+};
+
+template<typename T>
+using LogArgT = typename LogArg<std::decay_t<T>>::type;
+
+enum class LogArgKind : std::uint8_t {
+    kSigned,
+    kUnsigned,
+    kChar,
+    kBool,
+    kFloat,
+    kString,  // pointer to a string with static storage duration
+};
+
+struct LogArgType {
+    LogArgKind kind_;
+    std::uint8_t size_;
+};
+
+template<typename T>
+constexpr LogArgType LogArgTypeOf() {
+    if constexpr (std::is_same_v<T, bool>) {
+        return {LogArgKind::kBool, 1};
+    } else if constexpr (std::is_same_v<T, char> || std::is_same_v<T, signed char> ||
+                         std::is_same_v<T, unsigned char>) {
+        return {LogArgKind::kChar, 1};
+    } else if constexpr (std::is_integral_v<T>) {
+        return {std::is_signed_v<T> ? LogArgKind::kSigned : LogArgKind::kUnsigned, sizeof(T)};
+    } else if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+        return {LogArgKind::kFloat, sizeof(T)};
+    } else if constexpr (std::is_same_v<T, const char *> || std::is_same_v<T, char *>) {
+        return {LogArgKind::kString, sizeof(T)};
+    } else {
+        static_assert(sizeof(T) == 0, "unsupported log argument type");
+    }
+}
+
+constexpr std::size_t kMaxLogArgs = 16;
+
+// Static description of one sync_log call shape. Records carry a pointer to it plus the raw
+// argument bytes; formatting is deferred to whoever reads the record.
+struct LogFormat {
+    std::uint16_t id_;
+    std::uint8_t arity_;
+    std::array<LogArgType, kMaxLogArgs> args_;
+    std::size_t payload_size_;
+};
+
+inline std::atomic<std::uint16_t> next_log_format_id = 0;
+
+template<typename... Ts>
+const LogFormat &LogFormatOf() {
+    static_assert(sizeof...(Ts) <= kMaxLogArgs, "too many log arguments");
+    static const LogFormat format{next_log_format_id++, sizeof...(Ts), {LogArgTypeOf<Ts>()...},
+                                  (sizeof(Ts) + ... + 0)};
+    return format;
+}
+
+template<typename T>
+T LoadLogValue(const std::byte *&at) {
+    T value;
+    std::memcpy(&value, at, sizeof(T));
+    at += sizeof(T);
+    return value;
+}
+
+// Writes the record exactly as the original operator<< chain would have.
+// ResolveString maps a stored string pointer to the characters to print.
+template<class OStream, typename ResolveString>
+void FormatLogRecord(OStream &os, const LogFormat &format, const std::byte *at, ResolveString &&resolve) {
+    for (std::size_t i = 0; i < format.arity_; ++i) {
+        const LogArgType type = format.args_[i];
+        switch (type.kind_) {
+            case LogArgKind::kSigned:
+                switch (type.size_) {
+                    case 2: os << LoadLogValue<std::int16_t>(at); break;
+                    case 4: os << LoadLogValue<std::int32_t>(at); break;
+                    default: os << LoadLogValue<std::int64_t>(at); break;
+                }
+                break;
+            case LogArgKind::kUnsigned:
+                switch (type.size_) {
+                    case 2: os << LoadLogValue<std::uint16_t>(at); break;
+                    case 4: os << LoadLogValue<std::uint32_t>(at); break;
+                    default: os << LoadLogValue<std::uint64_t>(at); break;
+                }
+                break;
+            case LogArgKind::kChar:
+                os << LoadLogValue<char>(at);
+                break;
+            case LogArgKind::kBool:
+                os << LoadLogValue<bool>(at);
+                break;
+            case LogArgKind::kFloat:
+                if (type.size_ == sizeof(float)) {
+                    os << LoadLogValue<float>(at);
+                } else {
+                    os << LoadLogValue<double>(at);
+                }
+                break;
+            case LogArgKind::kString:
+                os << resolve(LoadLogValue<std::uintptr_t>(at));
+                break;
+        }
+    }
+}
+
+// Binary log stream: an 8 byte magic followed by tagged entries. Format and string
+// definitions are emitted the first time a record refers to them, so the file is
+// self-describing and can be turned back into text offline by DecodeBinaryLog.
+// Values are stored in native byte order.
+namespace binary_log {
+constexpr char kMagic[8] = {'A', 'B', 'C', '5', 'L', 'O', 'G', '1'};
+constexpr char kFormatTag = 'F';   // u16 id, u8 arity, arity * (u8 kind, u8 size)
+constexpr char kStringTag = 'S';   // u64 pointer, u32 length, characters
+constexpr char kRecordTag = 'R';   // u16 format id, payload
+constexpr char kDroppedTag = 'D';  // u64 count
+}  // namespace binary_log
+
+class BinaryLogWriter {
+    std::ostream &out_;
+    std::vector<bool> formats_written_;
+    std::unordered_set<std::uintptr_t> strings_written_;
+
+    template<typename T>
+    void Put(T value) {
+        out_.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+public:
+    explicit BinaryLogWriter(std::ostream &out)
+            : out_(out) {
+        out_.write(binary_log::kMagic, sizeof(binary_log::kMagic));
+    }
+
+    void WriteRecord(const LogFormat &format, const std::byte *payload) {
+        if (formats_written_.size() <= format.id_) {
+            formats_written_.resize(format.id_ + 1);
+        }
+        if (!formats_written_[format.id_]) {
+            formats_written_[format.id_] = true;
+            Put(binary_log::kFormatTag);
+            Put(format.id_);
+            Put(format.arity_);
+            for (std::size_t i = 0; i < format.arity_; ++i) {
+                Put(static_cast<std::uint8_t>(format.args_[i].kind_));
+                Put(format.args_[i].size_);
+            }
+        }
+
+        const std::byte *at = payload;
+        for (std::size_t i = 0; i < format.arity_; ++i) {
+            if (format.args_[i].kind_ == LogArgKind::kString) {
+                auto pointer = LoadLogValue<std::uintptr_t>(at);
+                if (strings_written_.insert(pointer).second) {
+                    const char *text = reinterpret_cast<const char *>(pointer);
+                    auto length = static_cast<std::uint32_t>(std::strlen(text));
+                    Put(binary_log::kStringTag);
+                    Put(static_cast<std::uint64_t>(pointer));
+                    Put(length);
+                    out_.write(text, length);
+                }
+            } else {
+                at += format.args_[i].size_;
+            }
+        }
+
+        Put(binary_log::kRecordTag);
+        Put(format.id_);
+        out_.write(reinterpret_cast<const char *>(payload), static_cast<std::streamsize>(format.payload_size_));
+    }
+
+    void WriteDropped(std::uint64_t count) {
+        Put(binary_log::kDroppedTag);
+        Put(count);
+    }
+
+    void Flush() {
+        out_.flush();
+    }
+};
+
+inline void WriteDroppedNotice(std::ostream &os, std::uint64_t count) {
+    os << "[sync_log dropped " << count << " records]\n";
+}
+
+// Turns a stream produced by BinaryLogWriter back into the text the synchronous logger prints.
+inline bool DecodeBinaryLog(std::istream &in, std::ostream &out) {
+    auto get = [&in](auto &value) {
+        return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+    };
+
+    char magic[sizeof(binary_log::kMagic)];
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, binary_log::kMagic, sizeof(magic)) != 0) {
+        return false;
+    }
+
+    std::vector<LogFormat> formats;
+    std::unordered_map<std::uint64_t, std::string> strings;
+    std::vector<std::byte> payload;
+    auto resolve = [&strings](std::uintptr_t pointer) -> const std::string & {
+        return strings[pointer];
+    };
+
+    char tag;
+    while (get(tag)) {
+        switch (tag) {
+            case binary_log::kFormatTag: {
+                LogFormat format{};
+                if (!get(format.id_) || !get(format.arity_) || format.arity_ > kMaxLogArgs) {
+                    return false;
+                }
+                for (std::size_t i = 0; i < format.arity_; ++i) {
+                    std::uint8_t kind;
+                    if (!get(kind) || !get(format.args_[i].size_)) {
+                        return false;
+                    }
+                    format.args_[i].kind_ = static_cast<LogArgKind>(kind);
+                    format.payload_size_ += format.args_[i].size_;
+                }
+                if (formats.size() <= format.id_) {
+                    formats.resize(format.id_ + 1);
+                }
+                formats[format.id_] = format;
+                break;
+            }
+            case binary_log::kStringTag: {
+                std::uint64_t pointer;
+                std::uint32_t length;
+                if (!get(pointer) || !get(length)) {
+                    return false;
+                }
+                std::string text(length, '\0');
+                if (!in.read(text.data(), length)) {
+                    return false;
+                }
+                strings[pointer] = std::move(text);
+                break;
+            }
+            case binary_log::kRecordTag: {
+                std::uint16_t id;
+                if (!get(id) || id >= formats.size()) {
+                    return false;
+                }
+                const LogFormat &format = formats[id];
+                payload.resize(format.payload_size_);
+                if (!in.read(reinterpret_cast<char *>(payload.data()), static_cast<std::streamsize>(payload.size()))) {
+                    return false;
+                }
+                FormatLogRecord(out, format, payload.data(), resolve);
+                break;
+            }
+            case binary_log::kDroppedTag: {
+                std::uint64_t count;
+                if (!get(count)) {
+                    return false;
+                }
+                WriteDroppedNotice(out, count);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return in.eof();
+}
+
+// Largest --log-segment-mb: 64 GiB segments, far below where the MiB-to-bytes shift overflows.
+constexpr std::size_t kMaxLogSegmentMb = 65536;
+
+// Log file backed by pre-allocated, memory-mapped segments `<path>.0`, `<path>.1`, ...
+// Appends are plain copies into the mapping; the kernel writes pages back on its own, so
+// a crashed process still leaves every completed append in the file (followed by zero
+// padding up to the segment size). Once a segment holds `rotate_bytes`, the next line
+// break starts a new segment, so lines are never split across files.
+class MappedLogFile : public std::streambuf {
+    std::string path_;
+    std::size_t rotate_bytes_;
+    std::size_t capacity_;
+    std::size_t segment_index_ = 0;
+    int fd_ = -1;
+    char *base_ = nullptr;
+
+    [[noreturn]] void Fail(const char *what) {
+        throw std::system_error(errno, std::generic_category(), what + (" " + SegmentPath()));
+    }
+
+    std::string SegmentPath() const {
+        return path_ + "." + std::to_string(segment_index_);
+    }
+
+    void OpenSegment() {
+        fd_ = ::open(SegmentPath().c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            Fail("cannot open log segment");
+        }
+        // Reserve the blocks up front: running out of disk later would be a SIGBUS, not an error.
+        if (int error = ::posix_fallocate(fd_, 0, static_cast<off_t>(capacity_)); error != 0) {
+            errno = error;
+            Fail("cannot allocate log segment");
+        }
+        void *mapping = ::mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (mapping == MAP_FAILED) {
+            Fail("cannot map log segment");
+        }
+        base_ = static_cast<char *>(mapping);
+        setp(base_, base_ + capacity_);
+    }
+
+    void CloseSegment() {
+        if (base_ == nullptr) {
+            return;
+        }
+        auto used = static_cast<off_t>(pptr() - base_);
+        ::munmap(base_, capacity_);
+        if (::ftruncate(fd_, used) != 0) {
+            // The segment is still readable, it just keeps its zero padding.
+        }
+        ::close(fd_);
+        base_ = nullptr;
+        fd_ = -1;
+        setp(nullptr, nullptr);
+    }
+
+    void Rotate() {
+        CloseSegment();
+        ++segment_index_;
+        OpenSegment();
+    }
+
+    std::size_t Used() const {
+        return static_cast<std::size_t>(pptr() - pbase());
+    }
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize count) override {
+        std::streamsize left = count;
+        while (left > 0) {
+            auto chunk = static_cast<std::size_t>(left);
+            bool rotate_after = false;
+            if (Used() >= rotate_bytes_) {
+                if (const void *newline = std::memchr(data, '\n', chunk)) {
+                    chunk = static_cast<const char *>(newline) - data + 1;
+                    rotate_after = true;
+                }
+            }
+            chunk = std::min(chunk, static_cast<std::size_t>(epptr() - pptr()));
+            std::memcpy(pptr(), data, chunk);
+            pbump(static_cast<int>(chunk));
+            data += chunk;
+            left -= static_cast<std::streamsize>(chunk);
+            // Past the threshold the headroom only has to absorb the rest of a line;
+            // a line that outgrows it is split rather than lost.
+            if (rotate_after || pptr() == epptr()) {
+                Rotate();
+            }
+        }
+        return count;
+    }
+
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof())) {
+            return traits_type::not_eof(ch);
+        }
+        char c = traits_type::to_char_type(ch);
+        xsputn(&c, 1);
+        return ch;
+    }
+
+public:
+    MappedLogFile(std::string path, std::size_t rotate_bytes)
+            : path_(std::move(path)), rotate_bytes_(rotate_bytes),
+              capacity_(rotate_bytes + std::max<std::size_t>(rotate_bytes / 8, 64 * 1024)) {
+        OpenSegment();
+    }
+
+    MappedLogFile(const MappedLogFile &) = delete;
+    MappedLogFile &operator=(const MappedLogFile &) = delete;
+
+    ~MappedLogFile() override {
+        CloseSegment();
+    }
+};
+
+// Build with -DABC5_PROFILE_LOCKS=1 to make the hot mutexes (hive_mutex_, queue_mutex_,
+// io_mutex_) ProfiledMutex and log a contention report at shutdown.
+#ifndef ABC5_PROFILE_LOCKS
+#define ABC5_PROFILE_LOCKS 0
+#endif
+
+// Acquisitions of a mutex from one call site and how long they held it.
+struct LockSiteProfile {
+    const char *file_ = nullptr;
+    const char *function_ = nullptr;
+    std::uint_least32_t line_ = 0;
+    std::uint64_t acquisitions_ = 0;
+    std::uint64_t hold_ns_ = 0;
+};
+
+struct LockProfile {
+    const char *name_ = "";
+    std::uint64_t acquisitions_ = 0;
+    std::uint64_t contended_ = 0;  // acquisitions that found the mutex taken
+    std::uint64_t wait_ns_ = 0;
+    std::uint64_t max_wait_ns_ = 0;
+    std::uint64_t hold_ns_ = 0;
+    std::uint64_t max_hold_ns_ = 0;
+    std::vector<LockSiteProfile> sites_;
+
+    LockSiteProfile &Site(const char *file, const char *function, std::uint_least32_t line) {
+        for (auto &site: sites_) {
+            if (site.line_ == line && site.file_ == file) {
+                return site;
+            }
+        }
+        return sites_.emplace_back(LockSiteProfile{file, function, line});
+    }
+
+    void Merge(const LockProfile &other) {
+        acquisitions_ += other.acquisitions_;
+        contended_ += other.contended_;
+        wait_ns_ += other.wait_ns_;
+        max_wait_ns_ = std::max(max_wait_ns_, other.max_wait_ns_);
+        hold_ns_ += other.hold_ns_;
+        max_hold_ns_ = std::max(max_hold_ns_, other.max_hold_ns_);
+        for (const auto &site: other.sites_) {
+            LockSiteProfile &merged = Site(site.file_, site.function_, site.line_);
+            merged.acquisitions_ += site.acquisitions_;
+            merged.hold_ns_ += site.hold_ns_;
+        }
+    }
+};
+
+// A std::mutex that counts acquisitions, contended acquisitions, wait and hold time, and hold
+// time per call site. The profile is only touched by the holder, so it needs no lock of its own.
+// Acquisitions through std::unique_lock or a condition variable wait are attributed to the
+// library code that took them; LockHot passes the real call site.
+class ProfiledMutex {
+    std::mutex mutex_;
+    LockProfile profile_;          // under mutex_
+    std::size_t holder_site_ = 0;  // under mutex_
+    std::int64_t acquired_at_ns_ = 0;  // under mutex_
+
+    static std::int64_t NowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Acquired(const std::source_location &site, std::int64_t wait_ns, bool contended) {
+        acquired_at_ns_ = NowNs();
+        ++profile_.acquisitions_;
+        profile_.contended_ += contended;
+        profile_.wait_ns_ += wait_ns;
+        profile_.max_wait_ns_ = std::max<std::uint64_t>(profile_.max_wait_ns_, wait_ns);
+        LockSiteProfile &holder = profile_.Site(site.file_name(), site.function_name(), site.line());
+        ++holder.acquisitions_;
+        holder_site_ = static_cast<std::size_t>(&holder - profile_.sites_.data());
+    }
+
+public:
+    explicit ProfiledMutex(const char *name);
+    ~ProfiledMutex();
+
+    ProfiledMutex(const ProfiledMutex &) = delete;
+    ProfiledMutex &operator=(const ProfiledMutex &) = delete;
+
+    void lock(std::source_location site = std::source_location::current()) {
+        if (mutex_.try_lock()) {
+            Acquired(site, 0, false);
+            return;
+        }
+        std::int64_t started = NowNs();
+        mutex_.lock();
+        Acquired(site, NowNs() - started, true);
+    }
+
+    bool try_lock(std::source_location site = std::source_location::current()) {
+        if (!mutex_.try_lock()) {
+            return false;
+        }
+        Acquired(site, 0, false);
+        return true;
+    }
+
+    void unlock() {
+        auto held = static_cast<std::uint64_t>(NowNs() - acquired_at_ns_);
+        profile_.hold_ns_ += held;
+        profile_.max_hold_ns_ = std::max(profile_.max_hold_ns_, held);
+        profile_.sites_[holder_site_].hold_ns_ += held;
+        mutex_.unlock();
+    }
+
+    // Copies the profile without counting as an acquisition.
+    LockProfile Snapshot() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        return profile_;
+    }
+};
+
+// Every ProfiledMutex, live or destroyed, so the report at shutdown covers them all.
+class LockProfiler {
+    std::mutex mutex_;
+    std::vector<ProfiledMutex *> live_;
+    std::vector<LockProfile> retired_;
+
+public:
+    void Register(ProfiledMutex *mutex) {
+        std::unique_lock<std::mutex> lock{mutex_};
+        live_.push_back(mutex);
+    }
+
+    void Retire(ProfiledMutex *mutex) {
+        LockProfile profile = mutex->Snapshot();
+        std::unique_lock<std::mutex> lock{mutex_};
+        live_.erase(std::find(live_.begin(), live_.end(), mutex));
+        retired_.push_back(std::move(profile));
+    }
+
+    // One profile per mutex name, most total wait first.
+    std::vector<LockProfile> Collect() {
+        std::vector<LockProfile> profiles;
+        auto add = [&](const LockProfile &profile) {
+            auto found = std::find_if(profiles.begin(), profiles.end(),
+                                      [&](const LockProfile &p) { return std::strcmp(p.name_, profile.name_) == 0; });
+            if (found == profiles.end()) {
+                profiles.push_back(profile);
+            } else {
+                found->Merge(profile);
+            }
+        };
+        std::unique_lock<std::mutex> lock{mutex_};
+        for (ProfiledMutex *mutex: live_) {
+            add(mutex->Snapshot());
+        }
+        for (const auto &profile: retired_) {
+            add(profile);
+        }
+        std::sort(profiles.begin(), profiles.end(),
+                  [](const LockProfile &a, const LockProfile &b) { return a.wait_ns_ > b.wait_ns_; });
+        return profiles;
+    }
+};
+
+// Defined before any ProfiledMutex with static storage, such as sync_logger's.
+static LockProfiler lock_profiler;
+
+inline ProfiledMutex::ProfiledMutex(const char *name) {
+    profile_.name_ = name;
+    lock_profiler.Register(this);
+}
+
+inline ProfiledMutex::~ProfiledMutex() {
+    lock_profiler.Retire(this);
+}
+
+// std::mutex with a name, so hot mutexes are declared the same way whether profiled or not.
+struct NamedMutex : std::mutex {
+    explicit NamedMutex(const char *) {}
+};
+
+#if ABC5_PROFILE_LOCKS
+using HotMutex = ProfiledMutex;
+using HotLock = std::unique_lock<ProfiledMutex>;
+using HotCondition = std::condition_variable_any;
+#else
+using HotMutex = NamedMutex;
+using HotLock = std::unique_lock<std::mutex>;
+using HotCondition = std::condition_variable;
+#endif
+
+// Locks a hot mutex, attributing the acquisition to the caller when profiling.
+inline HotLock LockHot(HotMutex &mutex, std::source_location site = std::source_location::current()) {
+#if ABC5_PROFILE_LOCKS
+    mutex.lock(site);
+    return HotLock{mutex, std::adopt_lock};
+#else
+    static_cast<void>(site);
+    return HotLock{mutex};
+#endif
+}
 
 template<class OStream>
 class SynchronizedOut {
-    OStream &out_;
-    std::mutex io_mutex_;
+    static constexpr std::size_t kPayloadSize = 112;
+
+    // Arguments are packed back to back into payload_ as described by format_.
+    struct Record {
+        const LogFormat *format_;
+        alignas(8) std::byte payload_[kPayloadSize];
+    };
+
+    enum class Backend {
+        kSync,      // format and write on the calling thread under io_mutex_
+        kAsync,     // push into a shared ring, a drain thread writes
+        kBuffered,  // append to a per-thread buffer, a flusher thread merges and writes in batches
+    };
+
+    struct TimedRecord {
+        std::chrono::steady_clock::time_point time_;
+        Record record_;
+    };
+
+    // Only ever contended by the flusher, so the owning thread's lock is a single uncontended RMW.
+    struct ThreadBuffer {
+        std::atomic_flag busy_ = ATOMIC_FLAG_INIT;
+        std::vector<TimedRecord> records_;
+        bool retired_ = false;
+
+        void Lock() {
+            while (busy_.test_and_set(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+
+        void Unlock() {
+            busy_.clear(std::memory_order_release);
+        }
+    };
+
+    static inline std::atomic<std::uint64_t> next_instance_id_ = 0;
+
+    OStream *out_;
+    HotMutex io_mutex_{"io_mutex_"};
+    const std::uint64_t instance_id_ = next_instance_id_++;
+
+    std::atomic<Backend> backend_ = Backend::kSync;
+    std::atomic<bool> muted_ = false;
+    std::unique_ptr<BinaryLogWriter> binary_out_;
+    std::thread drain_thread_;
+    std::atomic<bool> stop_drain_ = false;
+
+    OverflowPolicy policy_ = OverflowPolicy::kBlock;
+    std::unique_ptr<BoundedQueue<Record>> queue_;
+    std::atomic<std::size_t> dropped_ = 0;
+    std::atomic<std::size_t> enqueued_ = 0;
+    std::atomic<std::size_t> completed_ = 0;
+
+    std::size_t flush_records_ = 0;
+    std::chrono::milliseconds flush_interval_{0};
+    std::mutex registry_mutex_;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+    std::mutex flush_mutex_;
+    std::vector<std::vector<TimedRecord>> runs_;
+    std::mutex flush_wait_mutex_;
+    std::condition_variable flush_condition_;
+    std::atomic<bool> flush_requested_ = false;
+
+    template<typename T>
+    static void Store(std::byte *&at, const T &value) {
+        std::memcpy(at, &value, sizeof(T));
+        at += sizeof(T);
+    }
+
+    void Push(const Record &record) {
+        switch (policy_) {
+            case OverflowPolicy::kBlock:
+                while (!queue_->TryPush(record)) {
+                    std::this_thread::yield();
+                }
+                break;
+            case OverflowPolicy::kDropNewest:
+                if (!queue_->TryPush(record)) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                break;
+            case OverflowPolicy::kDropOldest:
+                while (!queue_->TryPush(record)) {
+                    Record victim;
+                    if (queue_->TryPop(victim)) {
+                        dropped_.fetch_add(1, std::memory_order_relaxed);
+                        completed_.fetch_add(1, std::memory_order_release);
+                    }
+                }
+                break;
+        }
+        enqueued_.fetch_add(1, std::memory_order_release);
+    }
+
+    void Emit(const Record &record) {
+        if (binary_out_) {
+            binary_out_->WriteRecord(*record.format_, record.payload_);
+        } else {
+            FormatLogRecord(*out_, *record.format_, record.payload_, [](std::uintptr_t pointer) {
+                return reinterpret_cast<const char *>(pointer);
+            });
+        }
+    }
+
+    void FlushOut() {
+        if (binary_out_) {
+            binary_out_->Flush();
+        } else {
+            out_->flush();
+        }
+    }
+
+    std::size_t DrainAvailable() {
+        std::size_t written = 0;
+        Record record;
+        while (queue_->TryPop(record)) {
+            Emit(record);
+            ++written;
+        }
+        if (std::size_t dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+            if (binary_out_) {
+                binary_out_->WriteDropped(dropped);
+            } else {
+                WriteDroppedNotice(*out_, dropped);
+            }
+        }
+        if (written > 0) {
+            FlushOut();
+            completed_.fetch_add(written, std::memory_order_release);
+        }
+        return written;
+    }
+
+    void Drain() {
+        int idle_rounds = 0;
+        for (;;) {
+            bool stopping = stop_drain_.load(std::memory_order_acquire);
+            if (DrainAvailable() > 0) {
+                idle_rounds = 0;
+            } else if (stopping) {
+                return;
+            } else if (++idle_rounds < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds{1});
+            }
+        }
+    }
+
+    ThreadBuffer &LocalBuffer() {
+        struct Slot {
+            std::uint64_t owner_;
+            std::shared_ptr<ThreadBuffer> buffer_;
+        };
+        // Buffers outlive their thread until the flusher has written them out.
+        struct Slots {
+            std::vector<Slot> slots_;
+
+            ~Slots() {
+                for (auto &slot: slots_) {
+                    slot.buffer_->Lock();
+                    slot.buffer_->retired_ = true;
+                    slot.buffer_->Unlock();
+                }
+            }
+        };
+        thread_local Slots local;
+
+        for (auto &slot: local.slots_) {
+            if (slot.owner_ == instance_id_) {
+                return *slot.buffer_;
+            }
+        }
+        auto buffer = std::make_shared<ThreadBuffer>();
+        buffer->records_.reserve(flush_records_);
+        {
+            std::unique_lock<std::mutex> lock{registry_mutex_};
+            buffers_.push_back(buffer);
+        }
+        local.slots_.push_back({instance_id_, buffer});
+        return *buffer;
+    }
+
+    void Append(const Record &record) {
+        ThreadBuffer &buffer = LocalBuffer();
+        buffer.Lock();
+        // Stamped under the buffer lock, so a flush cutoff taken before the flusher locks
+        // this buffer can never miss a record that is older than the cutoff.
+        buffer.records_.push_back({std::chrono::steady_clock::now(), record});
+        bool full = buffer.records_.size() >= flush_records_;
+        buffer.Unlock();
+
+        if (full && !flush_requested_.exchange(true, std::memory_order_relaxed)) {
+            flush_condition_.notify_one();
+        }
+    }
+
+    // Writes every buffered record stamped before the call, merged in timestamp order.
+    void FlushBuffers() {
+        std::unique_lock<std::mutex> flush_lock{flush_mutex_};
+        auto cutoff = std::chrono::steady_clock::now();
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        {
+            std::unique_lock<std::mutex> lock{registry_mutex_};
+            buffers = buffers_;
+        }
+
+        runs_.resize(buffers.size());
+        bool any_retired = false;
+        for (std::size_t i = 0; i < buffers.size(); ++i) {
+            ThreadBuffer &buffer = *buffers[i];
+            buffer.Lock();
+            auto &records = buffer.records_;
+            auto end = std::partition_point(records.begin(), records.end(), [cutoff](const TimedRecord &record) {
+                return record.time_ <= cutoff;
+            });
+            runs_[i].assign(records.begin(), end);
+            records.erase(records.begin(), end);
+            any_retired = any_retired || (buffer.retired_ && records.empty());
+            buffer.Unlock();
+        }
+
+        using Cursor = std::pair<std::chrono::steady_clock::time_point, std::size_t>;
+        std::priority_queue<Cursor, std::vector<Cursor>, std::greater<>> heads;
+        std::vector<std::size_t> positions(runs_.size(), 0);
+        for (std::size_t i = 0; i < runs_.size(); ++i) {
+            if (!runs_[i].empty()) {
+                heads.emplace(runs_[i].front().time_, i);
+            }
+        }
+        std::size_t written = 0;
+        while (!heads.empty()) {
+            std::size_t run = heads.top().second;
+            heads.pop();
+            Emit(runs_[run][positions[run]].record_);
+            ++written;
+            if (++positions[run] < runs_[run].size()) {
+                heads.emplace(runs_[run][positions[run]].time_, run);
+            }
+        }
+        if (written > 0) {
+            FlushOut();
+        }
+
+        if (any_retired) {
+            std::unique_lock<std::mutex> lock{registry_mutex_};
+            buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(), [](const auto &buffer) {
+                buffer->Lock();
+                bool done = buffer->retired_ && buffer->records_.empty();
+                buffer->Unlock();
+                return done;
+            }), buffers_.end());
+        }
+    }
+
+    void FlushPeriodically() {
+        std::unique_lock<std::mutex> lock{flush_wait_mutex_};
+        while (!stop_drain_.load(std::memory_order_acquire)) {
+            flush_condition_.wait_for(lock, flush_interval_, [this]() {
+                return flush_requested_.load(std::memory_order_relaxed) || stop_drain_.load(std::memory_order_acquire);
+            });
+            flush_requested_.store(false, std::memory_order_relaxed);
+            lock.unlock();
+            FlushBuffers();
+            lock.lock();
+        }
+        lock.unlock();
+        FlushBuffers();
+    }
 
 public:
     SynchronizedOut(OStream &os)
-            : out_(os) {}
+            : out_(&os) {}
 
-    template<typename... Args>
-    void Log(Args &&... args) {
-        std::unique_lock<std::mutex> lock{io_mutex_};
-        (out_ << ... << std::forward<Args>(args));
+    ~SynchronizedOut() {
+        StopAsync();
+    }
+
+    // Must be called while no other thread is logging.
+    void Redirect(OStream &os) {
+        out_ = &os;
+    }
+
+    // Drops every record until unmuted, e.g. for headless benchmark runs.
+    void Mute(bool muted) {
+        muted_.store(muted, std::memory_order_relaxed);
+    }
+
+    // Must be called before any other thread starts logging.
+    void StartAsync(std::size_t capacity, OverflowPolicy policy) {
+        policy_ = policy;
+        queue_ = std::make_unique<BoundedQueue<Record>>(capacity);
+        stop_drain_ = false;
+        drain_thread_ = std::thread([this]() { Drain(); });
+        backend_.store(Backend::kAsync, std::memory_order_release);
+    }
+
+    // Like StartAsync, but records are written unformatted to `sink` for DecodeBinaryLog.
+    // String arguments must point to storage that outlives the logger (e.g. literals).
+    void StartBinary(std::ostream &sink, std::size_t capacity, OverflowPolicy policy) {
+        binary_out_ = std::make_unique<BinaryLogWriter>(sink);
+        StartAsync(capacity, policy);
+    }
+
+    // Each thread appends to its own buffer; a flusher thread merges all buffers in timestamp
+    // order and writes them out in one batch every `interval`, or as soon as any buffer holds
+    // `flush_records` records. Must be called before any other thread starts logging.
+    void StartBuffered(std::size_t flush_records, std::chrono::milliseconds interval) {
+        flush_records_ = std::max<std::size_t>(flush_records, 1);
+        flush_interval_ = interval;
+        stop_drain_ = false;
+        drain_thread_ = std::thread([this]() { FlushPeriodically(); });
+        backend_.store(Backend::kBuffered, std::memory_order_release);
+    }
+
+    // Writes out everything still queued or buffered and returns to synchronous writes.
+    // Must be called once no other thread is logging.
+    void StopAsync() {
+        Backend backend = backend_.exchange(Backend::kSync);
+        if (backend == Backend::kSync) {
+            return;
+        }
+        stop_drain_.store(true, std::memory_order_release);
+        if (backend == Backend::kBuffered) {
+            std::unique_lock<std::mutex> lock{flush_wait_mutex_};
+            flush_condition_.notify_one();
+        }
+        drain_thread_.join();
+        binary_out_.reset();
+    }
+
+    // Blocks until every record logged before the call has been written out.
+    void Flush() {
+        switch (backend_.load(std::memory_order_acquire)) {
+            case Backend::kSync: {
+                auto lock = LockHot(io_mutex_);
+                out_->flush();
+                break;
+            }
+            case Backend::kAsync: {
+                std::size_t target = enqueued_.load(std::memory_order_acquire);
+                while (completed_.load(std::memory_order_acquire) < target) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+                }
+                break;
+            }
+            case Backend::kBuffered:
+                FlushBuffers();
+                break;
+        }
+    }
+
+    template<typename... Args>
+    void Log(Args &&... args) {
+        LogAt(std::source_location::current(), std::forward<Args>(args)...);
+    }
+
+    // Log, with io_mutex_ acquisitions charged to `site` in the lock profile.
+    template<typename... Args>
+    void LogAt(const std::source_location &site, Args &&... args) {
+        if (muted_.load(std::memory_order_relaxed)) {
+            return;
+        }
+        Backend backend = backend_.load(std::memory_order_acquire);
+        if (backend == Backend::kSync) {
+            auto lock = LockHot(io_mutex_, site);
+            (*out_ << ... << std::forward<Args>(args));
+            return;
+        }
+
+        static_assert((sizeof(LogArgT<Args>) + ... + 0) <= kPayloadSize, "too many log arguments");
+        Record record;
+        record.format_ = &LogFormatOf<LogArgT<Args>...>();
+        std::byte *at = record.payload_;
+        (Store(at, static_cast<LogArgT<Args>>(args)), ...);
+        if (backend == Backend::kAsync) {
+            Push(record);
+        } else {
+            Append(record);
+        }
+    }
+};
+
+static SynchronizedOut sync_logger{std::cout};
+constexpr auto sync_log = [](auto &&... args) {
+    sync_logger.Log(std::forward<decltype(args)>(args)...);
+};
+
+enum class LogLevel {
+    kTrace,
+    kDebug,
+    kInfo,
+    kWarn,
+    kOff,
+};
+
+// Build with -DABC5_MIN_LOG_LEVEL=<0..4> (trace, debug, info, warn, off) to compile out lower levels.
+#ifndef ABC5_MIN_LOG_LEVEL
+#define ABC5_MIN_LOG_LEVEL 0
+#endif
+
+constexpr LogLevel kMinLogLevel = static_cast<LogLevel>(ABC5_MIN_LOG_LEVEL);
+
+template<LogLevel Level>
+constexpr bool kLogEnabled = Level >= kMinLogLevel;
+
+// Logs at LogLevel::level. Below kMinLogLevel the whole call, argument evaluation included,
+// is discarded at compile time. The lock profile charges io_mutex_ to the SYNC_LOG line.
+#define SYNC_LOG(level, ...)                                                    \
+    do {                                                                        \
+        if constexpr (kLogEnabled<LogLevel::level>) {                           \
+            sync_logger.LogAt(std::source_location::current(), __VA_ARGS__);    \
+        }                                                                       \
+    } while (false)
+
+enum class HiveEventType : std::uint8_t {
+    kBeeReleased,
+    kBeeReturned,
+    kAttackAttempt,
+    kAttackSuccess,
+    kCure,
+    kShutdown,
+};
+
+constexpr std::string_view HiveEventName(HiveEventType type) {
+    switch (type) {
+        case HiveEventType::kBeeReleased: return "BeeReleased";
+        case HiveEventType::kBeeReturned: return "BeeReturned";
+        case HiveEventType::kAttackAttempt: return "AttackAttempt";
+        case HiveEventType::kAttackSuccess: return "AttackSuccess";
+        case HiveEventType::kCure: return "Cure";
+        case HiveEventType::kShutdown: return "Shutdown";
+    }
+    return "Unknown";
+}
+
+struct HiveEvent {
+    std::int64_t time_ns_;  // since the stream was started
+    HiveEventType type_;
+    std::int32_t bee_id_;   // kNoBee for events that are not about a single bee
+    std::int32_t honey_;
+    std::int32_t hive_size_;
+
+    static constexpr std::int32_t kNoBee = -1;
+};
+
+enum class EventFormat {
+    kJsonLines,
+    kCsv,
+};
+
+// Typed counterpart of the text log, meant for external analysis. Recording is a lock-free
+// push of a small POD; a drain thread serializes with to_chars into a fixed buffer, so
+// neither side allocates once the stream is running.
+class EventStream {
+    static constexpr std::size_t kBufferSize = 64 * 1024;
+    static constexpr std::size_t kMaxLineSize = 128;
+
+    std::ostream *out_ = nullptr;
+    EventFormat format_ = EventFormat::kJsonLines;
+    std::unique_ptr<BoundedQueue<HiveEvent>> queue_;
+    std::chrono::steady_clock::time_point epoch_;
+    std::atomic<bool> enabled_ = false;
+    std::atomic<bool> stop_drain_ = false;
+    std::thread drain_thread_;
+    std::array<char, kBufferSize> buffer_;
+    std::size_t buffered_ = 0;
+
+    static char *Append(char *at, std::string_view text) {
+        std::memcpy(at, text.data(), text.size());
+        return at + text.size();
+    }
+
+    static char *Append(char *at, std::int64_t value) {
+        return std::to_chars(at, at + 24, value).ptr;
+    }
+
+    char *Serialize(const HiveEvent &event, char *at) const {
+        bool has_bee = event.bee_id_ != HiveEvent::kNoBee;
+        if (format_ == EventFormat::kJsonLines) {
+            at = Append(at, "{\"time_ns\":");
+            at = Append(at, event.time_ns_);
+            at = Append(at, ",\"event\":\"");
+            at = Append(at, HiveEventName(event.type_));
+            at = Append(at, "\",\"bee\":");
+            at = has_bee ? Append(at, event.bee_id_) : Append(at, "null");
+            at = Append(at, ",\"honey\":");
+            at = Append(at, event.honey_);
+            at = Append(at, ",\"hive_size\":");
+            at = Append(at, event.hive_size_);
+            at = Append(at, "}\n");
+        } else {
+            at = Append(at, event.time_ns_);
+            at = Append(at, ",");
+            at = Append(at, HiveEventName(event.type_));
+            at = Append(at, ",");
+            at = has_bee ? Append(at, event.bee_id_) : at;
+            at = Append(at, ",");
+            at = Append(at, event.honey_);
+            at = Append(at, ",");
+            at = Append(at, event.hive_size_);
+            at = Append(at, "\n");
+        }
+        return at;
+    }
+
+    void WriteBuffer() {
+        out_->write(buffer_.data(), static_cast<std::streamsize>(buffered_));
+        buffered_ = 0;
+    }
+
+    void Drain() {
+        for (;;) {
+            bool stopping = stop_drain_.load(std::memory_order_acquire);
+            bool wrote = false;
+            HiveEvent event;
+            while (queue_->TryPop(event)) {
+                if (kBufferSize - buffered_ < kMaxLineSize) {
+                    WriteBuffer();
+                }
+                buffered_ = Serialize(event, buffer_.data() + buffered_) - buffer_.data();
+                wrote = true;
+            }
+            if (wrote) {
+                WriteBuffer();
+                out_->flush();
+            } else if (stopping) {
+                return;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds{1});
+            }
+        }
+    }
+
+public:
+    ~EventStream() {
+        Stop();
+    }
+
+    // Must be called before any other thread records events.
+    void Start(std::ostream &out, EventFormat format, std::size_t capacity) {
+        out_ = &out;
+        format_ = format;
+        queue_ = std::make_unique<BoundedQueue<HiveEvent>>(capacity);
+        epoch_ = std::chrono::steady_clock::now();
+        if (format_ == EventFormat::kCsv) {
+            *out_ << "time_ns,event,bee,honey,hive_size\n";
+        }
+        stop_drain_ = false;
+        drain_thread_ = std::thread([this]() { Drain(); });
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    // Writes out every recorded event. Must be called once no other thread is recording.
+    void Stop() {
+        if (!enabled_.exchange(false)) {
+            return;
+        }
+        stop_drain_.store(true, std::memory_order_release);
+        drain_thread_.join();
+    }
+
+    // Callers check this first so that disabled streams do not pay for gathering the fields.
+    bool Enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    std::int64_t Now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    void Record(const HiveEvent &event) {
+        while (!queue_->TryPush(event)) {
+            std::this_thread::yield();
+        }
+    }
+
+    void Record(HiveEventType type, std::int32_t bee_id, std::int32_t honey, std::int32_t hive_size) {
+        Record(HiveEvent{Now(), type, bee_id, honey, hive_size});
+    }
+};
+
+static EventStream event_stream;
+
+// Independent random streams. A draw is named by (stream, entity, event), e.g. the hunt time of
+// bee 7 on its 3rd trip, so its value depends only on the seed and not on which thread asks first.
+enum class RngStream : std::uint32_t {
+    kBeeHunt,
+    kHiveRelease,
+    kWinnie,
+};
+
+constexpr std::uint64_t kDefaultRngSeed = 5489;  // std::mt19937::default_seed, as before --seed
+
+// Set once from --seed before any engine starts.
+static std::uint64_t rng_seed = kDefaultRngSeed;
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3"): each 128-bit
+// counter block is bijectively scrambled under a 64-bit key, so there is no state to seed or
+// carry around, only a counter. The key is the seed; the counter is (block, event, entity,
+// stream). A draw that needs more than four words moves on to the next block of the same event.
+class PhiloxEngine {
+    static constexpr std::uint32_t kMultiplier0 = 0xD2511F53;
+    static constexpr std::uint32_t kMultiplier1 = 0xCD9E8D57;
+    static constexpr std::uint32_t kWeyl0 = 0x9E3779B9;
+    static constexpr std::uint32_t kWeyl1 = 0xBB67AE85;
+    static constexpr int kRounds = 10;
+
+    std::array<std::uint32_t, 2> key_;
+    std::array<std::uint32_t, 4> counter_;
+    std::array<std::uint32_t, 4> block_{};
+    int used_ = 4;
+
+public:
+    using result_type = std::uint32_t;
+
+    PhiloxEngine(std::uint64_t seed, RngStream stream, std::uint32_t entity, std::uint32_t event)
+            : key_{static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32)},
+              counter_{0, event, entity, static_cast<std::uint32_t>(stream)} {}
+
+    static std::array<std::uint32_t, 4> Block(std::array<std::uint32_t, 4> counter, std::array<std::uint32_t, 2> key) {
+        for (int round = 0; round < kRounds; ++round) {
+            std::uint64_t product0 = std::uint64_t{kMultiplier0} * counter[0];
+            std::uint64_t product1 = std::uint64_t{kMultiplier1} * counter[2];
+            counter = {static_cast<std::uint32_t>(product1 >> 32) ^ counter[1] ^ key[0], static_cast<std::uint32_t>(product1),
+                       static_cast<std::uint32_t>(product0 >> 32) ^ counter[3] ^ key[1], static_cast<std::uint32_t>(product0)};
+            key[0] += kWeyl0;
+            key[1] += kWeyl1;
+        }
+        return counter;
+    }
+
+    static constexpr result_type min() {
+        return 0;
+    }
+
+    static constexpr result_type max() {
+        return std::numeric_limits<result_type>::max();
+    }
+
+    result_type operator()() {
+        if (used_ == 4) {
+            block_ = Block(counter_, key_);
+            ++counter_[0];
+            used_ = 0;
+        }
+        return block_[used_++];
+    }
+};
+
+// First word of each named draw, i.e. what a fresh PhiloxEngine{seed, stream, entities[i],
+// events[i]} returns first, for a whole batch at once.
+using PhiloxKernel = void (*)(std::uint64_t seed, RngStream stream, const std::uint32_t *entities,
+                              const std::uint32_t *events, std::size_t count, std::uint32_t *words);
+
+// Scalar over [first, count); also finishes the tails of the vector kernels.
+inline void PhiloxFirstWordsFrom(std::size_t first, std::uint64_t seed, RngStream stream, const std::uint32_t *entities,
+                                 const std::uint32_t *events, std::size_t count, std::uint32_t *words) {
+    for (std::size_t i = first; i < count; ++i) {
+        words[i] = PhiloxEngine{seed, stream, entities[i], events[i]}();
+    }
+}
+
+inline void PhiloxFirstWordsScalar(std::uint64_t seed, RngStream stream, const std::uint32_t *entities,
+                                   const std::uint32_t *events, std::size_t count, std::uint32_t *words) {
+    PhiloxFirstWordsFrom(0, seed, stream, entities, events, count, words);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ABC5_X86_KERNELS 1
+
+// 32x32->64 multiply of all eight lanes. _mm256_mul_epu32 only multiplies the even lanes, so
+// the odd lanes go through a second multiply and the halves are blended back.
+__attribute__((target("avx2")))
+inline void MulHiLoAvx2(__m256i value, __m256i multiplier, __m256i &hi, __m256i &lo) {
+    __m256i even = _mm256_mul_epu32(value, multiplier);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), multiplier);
+    lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// Eight Philox counters per step, one per 32-bit lane.
+__attribute__((target("avx2")))
+inline void PhiloxFirstWordsAvx2(std::uint64_t seed, RngStream stream, const std::uint32_t *entities,
+                                 const std::uint32_t *events, std::size_t count, std::uint32_t *words) {
+    const __m256i multiplier0 = _mm256_set1_epi32(static_cast<int>(0xD2511F53));
+    const __m256i multiplier1 = _mm256_set1_epi32(static_cast<int>(0xCD9E8D57));
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        std::uint32_t key0 = static_cast<std::uint32_t>(seed), key1 = static_cast<std::uint32_t>(seed >> 32);
+        __m256i c0 = _mm256_setzero_si256();
+        __m256i c1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(events + i));
+        __m256i c2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entities + i));
+        __m256i c3 = _mm256_set1_epi32(static_cast<int>(stream));
+        for (int round = 0; round < 10; ++round) {
+            __m256i hi0, lo0, hi1, lo1;
+            MulHiLoAvx2(c0, multiplier0, hi0, lo0);
+            MulHiLoAvx2(c2, multiplier1, hi1, lo1);
+            c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(static_cast<int>(key0)));
+            c1 = lo1;
+            c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(static_cast<int>(key1)));
+            c3 = lo0;
+            key0 += 0x9E3779B9;
+            key1 += 0xBB67AE85;
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(words + i), c0);
+    }
+    PhiloxFirstWordsFrom(i, seed, stream, entities, events, count, words);
+}
+#endif
+
+struct PhiloxKernelChoice {
+    PhiloxKernel kernel_;
+    const char *name_;
+};
+
+// Picked once, from what the CPU we are running on supports.
+inline const PhiloxKernelChoice &SelectedPhiloxKernel() {
+    static const PhiloxKernelChoice choice = []() -> PhiloxKernelChoice {
+#ifdef ABC5_X86_KERNELS
+        if (__builtin_cpu_supports("avx2")) {
+            return {&PhiloxFirstWordsAvx2, "avx2"};
+        }
+#endif
+        return {&PhiloxFirstWordsScalar, "scalar"};
+    }();
+    return choice;
+}
+
+// Scratch for a batch of named draws: entity ids and event counters side by side, values out.
+struct RngBatch {
+    std::vector<std::uint32_t> entities_;
+    std::vector<std::uint32_t> events_;
+    std::vector<std::uint32_t> words_;
+    std::vector<int> values_;
+
+    void Clear() {
+        entities_.clear();
+        events_.clear();
+    }
+
+    void Add(std::uint32_t entity, std::uint32_t event) {
+        entities_.push_back(entity);
+        events_.push_back(event);
+    }
+
+    std::size_t Size() const {
+        return entities_.size();
+    }
+};
+
+// Time distributions map Philox words to milliseconds. Each one provides
+//   bool FromWord(std::uint32_t word, int &value) const  -- false if one word is not enough
+//   int Next(RNG &engine) const                          -- draw from as many words as it takes
+// and these two turn that into named draws that agree whether taken one by one or in batches.
+
+// The `event`-th draw of `entity` on `stream` under rng_seed.
+template<typename Distribution>
+int NamedDraw(const Distribution &distribution, RngStream stream, std::uint32_t entity, std::uint32_t event) {
+    PhiloxEngine engine{rng_seed, stream, entity, event};
+    return distribution.Next(engine);
+}
+
+// batch.values_[i] = NamedDraw(distribution, stream, batch.entities_[i], batch.events_[i]), with
+// the first word of every draw from the vector kernel. Only words FromWord refuses take the
+// scalar path.
+template<typename Distribution>
+void FillNamedDraws(const Distribution &distribution, RngStream stream, RngBatch &batch) {
+    std::size_t count = batch.Size();
+    batch.words_.resize(count);
+    batch.values_.resize(count);
+    SelectedPhiloxKernel().kernel_(rng_seed, stream, batch.entities_.data(), batch.events_.data(), count,
+                                   batch.words_.data());
+    for (std::size_t i = 0; i < count; ++i) {
+        if (!distribution.FromWord(batch.words_[i], batch.values_[i])) {
+            batch.values_[i] = NamedDraw(distribution, stream, batch.entities_[i], batch.events_[i]);
+        }
+    }
+}
+
+// Uniform ints in [Min, Max] by Lemire's multiply-shift ("Fast Random Integer Generation in an
+// Interval"): the high half of word * kRange, redrawing the rare words whose low half is below
+// kThreshold so every value is equally likely. Both constants are fixed at compile time, and
+// unlike std::uniform_int_distribution the mapping is the same with every standard library.
+template<int Min, int Max>
+struct RNGSettings {
+    static_assert(Min <= Max);
+    static constexpr std::uint32_t kRange = static_cast<std::uint32_t>(Max - Min) + 1;
+    static constexpr std::uint32_t kThreshold = (0u - kRange) % kRange;
+
+    // Maps one word; false if it must be redrawn.
+    static bool FromWord(std::uint32_t word, int &value) {
+        std::uint64_t product = std::uint64_t{word} * kRange;
+        value = Min + static_cast<int>(product >> 32);
+        return static_cast<std::uint32_t>(product) >= kThreshold;
+    }
+
+    template<typename RNG>
+    int Next(RNG &engine) const {
+        static_assert(RNG::min() == 0 && RNG::max() == std::numeric_limits<std::uint32_t>::max());
+        int value;
+        while (!FromWord(static_cast<std::uint32_t>(engine()), value)) {
+        }
+        return value;
+    }
+
+    int At(RngStream stream, std::uint32_t entity, std::uint32_t event) const {
+        return NamedDraw(*this, stream, entity, event);
+    }
+
+    void FillAt(RngStream stream, RngBatch &batch) const {
+        FillNamedDraws(*this, stream, batch);
+    }
+
+    double Mean() const {
+        return (Min + Max) / 2.0;
+    }
+};
+
+using BeeHuntSettings = RNGSettings<800, 1200>;
+using BeeReleaseSettings = RNGSettings<50, 100>;
+
+// Longest time any distribution hands out, so tails stay inside the timers' and the simulated
+// clock's range.
+constexpr int kMaxDrawnTimeMs = 3'600'000;
+
+// (word + 0.5) / 2^32: never 0 or 1, so logarithms and inverse CDFs stay finite.
+inline double OpenUnitInterval(std::uint32_t word) {
+    return (word + 0.5) * 0x1p-32;
+}
+
+// Clamps before rounding, so huge tails saturate instead of overflowing the integer; NaN counts
+// as the longest time.
+constexpr int ClampDrawnTime(double ms) {
+    double clamped = ms != ms ? kMaxDrawnTimeMs : std::clamp(ms, 1.0, static_cast<double>(kMaxDrawnTimeMs));
+    return static_cast<int>(clamped + 0.5);
+}
+
+static_assert(ClampDrawnTime(0.2) == 1 && ClampDrawnTime(-1e300) == 1 && ClampDrawnTime(999.5) == 1000);
+static_assert(ClampDrawnTime(1e20) == kMaxDrawnTimeMs);
+static_assert(ClampDrawnTime(std::numeric_limits<double>::infinity()) == kMaxDrawnTimeMs);
+static_assert(ClampDrawnTime(std::numeric_limits<double>::quiet_NaN()) == kMaxDrawnTimeMs);
+
+// RNGSettings with bounds only known at runtime.
+struct UniformTime {
+    int min_;
+    std::uint32_t range_;
+    std::uint32_t threshold_;
+
+    UniformTime(int min, int max)
+            : min_(min), range_(static_cast<std::uint32_t>(max - min) + 1), threshold_((0u - range_) % range_) {}
+
+    bool FromWord(std::uint32_t word, int &value) const {
+        std::uint64_t product = std::uint64_t{word} * range_;
+        value = min_ + static_cast<int>(product >> 32);
+        return static_cast<std::uint32_t>(product) >= threshold_;
+    }
+
+    template<typename RNG>
+    int Next(RNG &engine) const {
+        int value;
+        while (!FromWord(engine(), value)) {
+        }
+        return value;
+    }
+
+    double Mean() const {
+        return min_ + (range_ - 1) / 2.0;
+    }
+};
+
+// Memoryless waits: -mean * ln(u).
+struct ExponentialTime {
+    double mean_;
+
+    bool FromWord(std::uint32_t word, int &value) const {
+        value = ClampDrawnTime(-mean_ * std::log(OpenUnitInterval(word)));
+        return true;
+    }
+
+    template<typename RNG>
+    int Next(RNG &engine) const {
+        int value;
+        FromWord(engine(), value);
+        return value;
+    }
+
+    double Mean() const {
+        return mean_;
+    }
+};
+
+// Acklam's rational approximation of the standard normal inverse CDF (relative error < 1.2e-9),
+// so a normal deviate costs one word instead of Box-Muller's two.
+inline double InverseNormalCdf(double p) {
+    constexpr double a[] = {-3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+                            1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00};
+    constexpr double b[] = {-5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+                            6.680131188771972e+01, -1.328068155288572e+01};
+    constexpr double c[] = {-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+                            -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00};
+    constexpr double d[] = {7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+                            3.754408661907416e+00};
+    constexpr double kLow = 0.02425;
+    if (p < kLow || p > 1 - kLow) {
+        double q = std::sqrt(-2 * std::log(p < kLow ? p : 1 - p));
+        double x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+                   ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+        return p < kLow ? x : -x;
+    }
+    double q = p - 0.5;
+    double r = q * q;
+    return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q /
+           (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+}
+
+// Right-skewed forager latencies: median * exp(sigma * z).
+struct LogNormalTime {
+    double median_;
+    double sigma_;
+
+    bool FromWord(std::uint32_t word, int &value) const {
+        value = ClampDrawnTime(median_ * std::exp(sigma_ * InverseNormalCdf(OpenUnitInterval(word))));
+        return true;
+    }
+
+    template<typename RNG>
+    int Next(RNG &engine) const {
+        int value;
+        FromWord(engine(), value);
+        return value;
+    }
+
+    double Mean() const {
+        return median_ * std::exp(sigma_ * sigma_ / 2);
+    }
+};
+
+// Weighted discrete times, sampled in O(1) with Vose's alias method: the high half of
+// word * columns picks a column, the low half is the coin between it and its alias.
+struct AliasTime {
+    std::vector<int> values_;
+    std::vector<std::uint64_t> keep_;  // keep values_[column] if coin < keep_[column], out of 2^32
+    std::vector<std::uint32_t> alias_;
+    double mean_ = 0;
+
+    AliasTime(std::vector<int> values, const std::vector<double> &weights)
+            : values_(std::move(values)), keep_(values_.size()), alias_(values_.size()) {
+        std::size_t n = values_.size();
+        double total = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            total += weights[i];
+            mean_ += values_[i] * weights[i];
+        }
+        mean_ /= total;
+
+        std::vector<double> scaled(n);
+        std::vector<std::uint32_t> small, large;
+        for (std::size_t i = 0; i < n; ++i) {
+            scaled[i] = weights[i] * n / total;
+            (scaled[i] < 1 ? small : large).push_back(static_cast<std::uint32_t>(i));
+        }
+        while (!small.empty() && !large.empty()) {
+            std::uint32_t less = small.back(), more = large.back();
+            small.pop_back();
+            keep_[less] = static_cast<std::uint64_t>(scaled[less] * 0x1p32);
+            alias_[less] = more;
+            scaled[more] -= 1 - scaled[less];
+            if (scaled[more] < 1) {
+                large.pop_back();
+                small.push_back(more);
+            }
+        }
+        // Leftovers are 1 up to rounding.
+        for (auto *rest: {&small, &large}) {
+            for (std::uint32_t i: *rest) {
+                keep_[i] = std::uint64_t{1} << 32;
+                alias_[i] = i;
+            }
+        }
+    }
+
+    bool FromWord(std::uint32_t word, int &value) const {
+        std::uint64_t product = std::uint64_t{word} * values_.size();
+        std::size_t column = product >> 32;
+        value = static_cast<std::uint32_t>(product) < keep_[column] ? values_[column] : values_[alias_[column]];
+        return true;
+    }
+
+    template<typename RNG>
+    int Next(RNG &engine) const {
+        int value;
+        FromWord(engine(), value);
+        return value;
+    }
+
+    double Mean() const {
+        return mean_;
+    }
+};
+
+// A hunt or release time distribution picked at runtime. The variant is visited once per draw
+// or per batch, never per word, and sampling never allocates.
+class TimeDistribution {
+    std::variant<BeeHuntSettings, BeeReleaseSettings, UniformTime, ExponentialTime, LogNormalTime, AliasTime> policy_;
+
+    // A whole number of milliseconds in the range every draw is clamped to. Rejects NaN and inf.
+    static bool IsDrawnTimeMs(double ms) {
+        return std::isfinite(ms) && ms == std::floor(ms) && ms >= 1 && ms <= kMaxDrawnTimeMs;
+    }
+
+    static bool IsPositiveFinite(double x) {
+        return std::isfinite(x) && x > 0;
+    }
+
+    static std::optional<AliasTime> MakeAlias(std::vector<int> values, const std::vector<double> &weights) {
+        if (values.empty() || values.size() != weights.size()) {
+            return std::nullopt;
+        }
+        for (std::size_t i = 0; i < values.size(); ++i) {
+            if (values[i] < 1 || values[i] > kMaxDrawnTimeMs || !std::isfinite(weights[i]) || !(weights[i] >= 0)) {
+                return std::nullopt;
+            }
+        }
+        if (std::all_of(weights.begin(), weights.end(), [](double weight) { return weight == 0; })) {
+            return std::nullopt;
+        }
+        return AliasTime{std::move(values), weights};
+    }
+
+public:
+    template<typename Policy>
+    TimeDistribution(Policy policy)
+            : policy_(std::move(policy)) {}
+
+    // One of
+    //   uniform:MIN:MAX          milliseconds, inclusive
+    //   exponential:MEAN
+    //   lognormal:MEDIAN:SIGMA
+    //   discrete:MS=WEIGHT,...
+    //   histogram:FILE           one "MS WEIGHT" pair per line, '#' starts a comment
+    static std::optional<TimeDistribution> Parse(std::string_view spec) {
+        std::string_view kind = spec.substr(0, spec.find(':'));
+        std::string_view rest = kind.size() < spec.size() ? spec.substr(kind.size() + 1) : std::string_view{};
+        std::vector<double> numbers;
+        auto parse_numbers = [&](std::string_view text, char separator) {
+            numbers.clear();
+            while (!text.empty()) {
+                std::size_t end = std::min(text.find(separator), text.size());
+                double number;
+                auto [ptr, ec] = std::from_chars(text.data(), text.data() + end, number);
+                if (ec != std::errc{} || ptr != text.data() + end) {
+                    return false;
+                }
+                numbers.push_back(number);
+                text.remove_prefix(std::min(end + 1, text.size()));
+            }
+            return true;
+        };
+
+        if (kind == "uniform") {
+            if (!parse_numbers(rest, ':') || numbers.size() != 2 || !IsDrawnTimeMs(numbers[0]) ||
+                !IsDrawnTimeMs(numbers[1]) || !(numbers[1] >= numbers[0])) {
+                return std::nullopt;
+            }
+            return TimeDistribution{UniformTime{static_cast<int>(numbers[0]), static_cast<int>(numbers[1])}};
+        }
+        if (kind == "exponential") {
+            if (!parse_numbers(rest, ':') || numbers.size() != 1 || !IsPositiveFinite(numbers[0])) {
+                return std::nullopt;
+            }
+            return TimeDistribution{ExponentialTime{numbers[0]}};
+        }
+        if (kind == "lognormal") {
+            if (!parse_numbers(rest, ':') || numbers.size() != 2 || !IsPositiveFinite(numbers[0]) ||
+                !std::isfinite(numbers[1]) || !(numbers[1] >= 0)) {
+                return std::nullopt;
+            }
+            return TimeDistribution{LogNormalTime{numbers[0], numbers[1]}};
+        }
+
+        std::vector<int> values;
+        std::vector<double> weights;
+        if (kind == "discrete") {
+            while (!rest.empty()) {
+                std::size_t end = std::min(rest.find(','), rest.size());
+                std::string_view pair = rest.substr(0, end);
+                rest.remove_prefix(std::min(end + 1, rest.size()));
+                std::size_t equals = pair.find('=');
+                if (equals == std::string_view::npos || !parse_numbers(pair.substr(0, equals), ':') ||
+                    numbers.size() != 1 || !IsDrawnTimeMs(numbers[0])) {
+                    return std::nullopt;
+                }
+                values.push_back(static_cast<int>(numbers[0]));
+                if (!parse_numbers(pair.substr(equals + 1), ':') || numbers.size() != 1) {
+                    return std::nullopt;
+                }
+                weights.push_back(numbers[0]);
+            }
+        } else if (kind == "histogram") {
+            std::ifstream in{std::string{rest}};
+            if (!in) {
+                return std::nullopt;
+            }
+            for (std::string line; std::getline(in, line);) {
+                line.erase(std::min(line.find('#'), line.size()));
+                std::istringstream fields{line};
+                int value;
+                double weight;
+                if (fields >> value >> weight) {
+                    values.push_back(value);
+                    weights.push_back(weight);
+                } else if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                    return std::nullopt;
+                }
+            }
+        } else {
+            return std::nullopt;
+        }
+        auto alias = MakeAlias(std::move(values), weights);
+        if (!alias) {
+            return std::nullopt;
+        }
+        return TimeDistribution{std::move(*alias)};
+    }
+
+    int At(RngStream stream, std::uint32_t entity, std::uint32_t event) const {
+        return std::visit([&](const auto &policy) { return NamedDraw(policy, stream, entity, event); }, policy_);
+    }
+
+    void FillAt(RngStream stream, RngBatch &batch) const {
+        std::visit([&](const auto &policy) { FillNamedDraws(policy, stream, batch); }, policy_);
+    }
+
+    double Mean() const {
+        return std::visit([](const auto &policy) { return policy.Mean(); }, policy_);
+    }
+};
+
+// Hunt and release time distributions for one hive; the defaults are the original uniform ranges.
+struct HiveTimes {
+    TimeDistribution hunt_ = BeeHuntSettings{};
+    TimeDistribution release_ = BeeReleaseSettings{};
+};
+
+using namespace std::literals;  // NOLINT
+
+enum class LatencyMetric {
+    kReleaseToWake,   // Bee::Hunt until the bee runs
+    kWakeToReturn,    // the bee runs until its return is recorded
+    kReturnToWinnie,  // honey reaches Winnie's threshold until Winnie acts on it
+    kHiveMutexWait,   // waiting to acquire CoroHive::hive_mutex_; the threaded hive has none
+    kCount,
+};
+
+constexpr const char *LatencyMetricName(LatencyMetric metric) {
+    switch (metric) {
+        case LatencyMetric::kReleaseToWake: return "release->wake";
+        case LatencyMetric::kWakeToReturn: return "wake->return";
+        case LatencyMetric::kReturnToWinnie: return "return->Winnie";
+        case LatencyMetric::kHiveMutexWait: return "coro hive_mutex_ wait";
+        case LatencyMetric::kCount: break;
+    }
+    return "?";
+}
+
+inline std::int64_t LatencyNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear bucketing in the style of HdrHistogram: values below 2^kSubBucketBits are exact,
+// every larger power of two is split into 2^(kSubBucketBits - 1) buckets, so a recorded value
+// is off by at most ~3%. Values above 2^kMaxBits ns (~69s) land in the last bucket.
+struct LatencyBuckets {
+    static constexpr int kSubBucketBits = 6;
+    static constexpr int kMaxBits = 36;
+    static constexpr std::size_t kCount = (std::size_t{kMaxBits - kSubBucketBits} << (kSubBucketBits - 1)) +
+                                          (std::size_t{1} << kSubBucketBits);
+
+    static std::size_t Of(std::int64_t ns) {
+        auto value = static_cast<std::uint64_t>(std::clamp<std::int64_t>(ns, 0, (std::int64_t{1} << kMaxBits) - 1));
+        int shift = std::max(0, static_cast<int>(std::bit_width(value)) - kSubBucketBits);
+        return (static_cast<std::size_t>(shift) << (kSubBucketBits - 1)) + (value >> shift);
+    }
+
+    // Largest value that falls into `bucket`.
+    static std::int64_t HighestIn(std::size_t bucket) {
+        if (bucket < (std::size_t{1} << kSubBucketBits)) {
+            return static_cast<std::int64_t>(bucket);
+        }
+        int shift = static_cast<int>(bucket >> (kSubBucketBits - 1)) - 1;
+        std::uint64_t sub = bucket - (static_cast<std::size_t>(shift) << (kSubBucketBits - 1));
+        return static_cast<std::int64_t>(((sub + 1) << shift) - 1);
+    }
+};
+
+// One shard's histogram. The threads sharing the shard record with relaxed atomics; anyone may
+// merge it at any time.
+struct LatencyHistogram {
+    std::array<std::atomic<std::uint64_t>, LatencyBuckets::kCount> counts_{};
+    std::atomic<std::int64_t> max_ = 0;
+
+    void Record(std::int64_t ns) {
+        counts_[LatencyBuckets::Of(ns)].fetch_add(1, std::memory_order_relaxed);
+        std::int64_t max = max_.load(std::memory_order_relaxed);
+        while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+// Several LatencyHistograms added up.
+class LatencySummary {
+    std::array<std::uint64_t, LatencyBuckets::kCount> counts_{};
+    std::uint64_t total_ = 0;
+    std::int64_t max_ = 0;
+
+public:
+    void Add(const LatencyHistogram &histogram) {
+        for (std::size_t i = 0; i < counts_.size(); ++i) {
+            std::uint64_t count = histogram.counts_[i].load(std::memory_order_relaxed);
+            counts_[i] += count;
+            total_ += count;
+        }
+        max_ = std::max(max_, histogram.max_.load(std::memory_order_relaxed));
+    }
+
+    std::uint64_t Count() const {
+        return total_;
+    }
+
+    std::int64_t Max() const {
+        return max_;
+    }
+
+    // Smallest bucket bound at or above a `quantile` fraction of the samples.
+    std::int64_t Percentile(double quantile) const {
+        auto rank = static_cast<std::uint64_t>(std::ceil(quantile * total_));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= std::max<std::uint64_t>(rank, 1)) {
+                return std::min(LatencyBuckets::HighestIn(i), max_);
+            }
+        }
+        return max_;
+    }
+};
+
+// Sharded latency histograms for every LatencyMetric. A thread is dealt a shard on its first
+// Record, round-robin over at most kShards, so a worker pool gets a shard per worker while
+// 10k bee threads still share 32 KB sets instead of owning one each. Shards outlive their
+// threads, so Report sees everything recorded.
+// One instance per process: the thread-local shard belongs to latency_stats.
+class LatencyStats {
+    using ShardHistograms = std::array<LatencyHistogram, static_cast<std::size_t>(LatencyMetric::kCount)>;
+
+    static constexpr std::size_t kShards = 64;
+
+    std::mutex shards_mutex_;
+    std::vector<std::unique_ptr<ShardHistograms>> shards_;
+    std::size_t next_shard_ = 0;
+
+    ShardHistograms &Local() {
+        thread_local ShardHistograms *local = nullptr;
+        if (local == nullptr) {
+            std::unique_lock<std::mutex> lock{shards_mutex_};
+            if (shards_.size() < kShards) {
+                shards_.push_back(std::make_unique<ShardHistograms>());
+            }
+            local = shards_[next_shard_++ % shards_.size()].get();
+        }
+        return *local;
+    }
+
+public:
+    void Record(LatencyMetric metric, std::int64_t ns) {
+        Local()[static_cast<std::size_t>(metric)].Record(ns);
+    }
+
+    // Forgets everything recorded so far. Only while no thread is recording.
+    void Reset() {
+        std::unique_lock<std::mutex> lock{shards_mutex_};
+        for (auto &histograms: shards_) {
+            for (auto &histogram: *histograms) {
+                for (auto &count: histogram.counts_) {
+                    count.store(0, std::memory_order_relaxed);
+                }
+                histogram.max_.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    LatencySummary Merge(LatencyMetric metric) {
+        LatencySummary summary;
+        std::unique_lock<std::mutex> lock{shards_mutex_};
+        for (auto &histograms: shards_) {
+            summary.Add((*histograms)[static_cast<std::size_t>(metric)]);
+        }
+        return summary;
+    }
+
+    // Logs p50/p99/p999/max of every metric that has samples. Bypasses ABC5_MIN_LOG_LEVEL:
+    // the report is what the histograms exist for.
+    void Report() {
+        for (std::size_t i = 0; i < static_cast<std::size_t>(LatencyMetric::kCount); ++i) {
+            auto metric = static_cast<LatencyMetric>(i);
+            LatencySummary summary = Merge(metric);
+            if (summary.Count() == 0) {
+                continue;
+            }
+            sync_log(LatencyMetricName(metric), ": p50=", summary.Percentile(0.5), " p99=", summary.Percentile(0.99),
+                     " p999=", summary.Percentile(0.999), " max=", summary.Max(), "ns n=", summary.Count(), "\n");
+        }
+    }
+};
+
+static LatencyStats latency_stats;
+
+// Logs each profiled mutex, most total wait first, with the call sites that held it longest.
+// Logs nothing unless built with ABC5_PROFILE_LOCKS, but bypasses ABC5_MIN_LOG_LEVEL.
+inline void ReportLockProfiles(std::size_t top_sites = 3) {
+    for (LockProfile &profile: lock_profiler.Collect()) {
+        if (profile.acquisitions_ == 0) {
+            continue;
+        }
+        sync_log(profile.name_, ": ", profile.acquisitions_, " acquisitions, ", profile.contended_, " contended\n");
+        sync_log("    wait total=", profile.wait_ns_, "ns max=", profile.max_wait_ns_, "ns, hold total=",
+                 profile.hold_ns_, "ns max=", profile.max_hold_ns_, "ns\n");
+        auto &sites = profile.sites_;
+        std::sort(sites.begin(), sites.end(),
+                  [](const LockSiteProfile &a, const LockSiteProfile &b) { return a.hold_ns_ > b.hold_ns_; });
+        for (std::size_t i = 0; i < std::min(top_sites, sites.size()); ++i) {
+            sync_log("    held ", sites[i].hold_ns_, "ns over ", sites[i].acquisitions_, " acquisitions at ",
+                     sites[i].file_, ":", sites[i].line_, " in ", sites[i].function_, "\n");
+        }
+    }
+}
+
+// Locks `mutex`, recording the wait under `metric`.
+inline HotLock LockRecordingWait(HotMutex &mutex, LatencyMetric metric,
+                                 std::source_location site = std::source_location::current()) {
+    std::int64_t started = LatencyNowNs();
+    HotLock lock = LockHot(mutex, site);
+    latency_stats.Record(metric, LatencyNowNs() - started);
+    return lock;
+}
+
+enum class TraceSpanType : std::uint8_t {
+    kHunt,         // release to return of one bee; arg is the bee id
+    kReleaseTick,  // one ReleaseBatch; arg is the number of bees released
+    kAttack,       // arg is 1 if the attack succeeded
+    kCure,
+};
+
+// Trace tracks within a hive: release ticks, Winnie, then one per bee.
+constexpr int kTraceHiveTrack = 0;
+constexpr int kTraceWinnieTrack = 1;
+constexpr int kTraceFirstBeeTrack = 2;
+
+struct TraceSpan {
+    std::int64_t start_ns_;  // LatencyNowNs clock
+    std::int64_t end_ns_;
+    std::int32_t track_;
+    std::int32_t arg_;
+    std::int16_t hive_;
+    TraceSpanType type_;
+};
+
+// Spans for a Chrome trace-event JSON timeline (Perfetto, chrome://tracing). Each thread
+// appends to its own chunks, so recording takes no lock and shares no cache line with other
+// threads; a thread takes threads_mutex_ once, to register. Write runs after every recording
+// thread has been joined. One instance per process: the thread-local chunks belong to
+// trace_recorder.
+class TraceRecorder {
+    static constexpr std::size_t kChunkSpans = 4096;
+
+    struct Chunk {
+        std::array<TraceSpan, kChunkSpans> spans_;
+        std::size_t size_ = 0;
+    };
+    using ThreadSpans = std::vector<std::unique_ptr<Chunk>>;
+
+    std::atomic<bool> enabled_ = false;
+    std::int64_t epoch_ns_ = 0;
+    std::mutex threads_mutex_;
+    std::vector<std::unique_ptr<ThreadSpans>> threads_;
+
+    ThreadSpans &Local() {
+        thread_local ThreadSpans *local = nullptr;
+        if (local == nullptr) {
+            auto spans = std::make_unique<ThreadSpans>();
+            local = spans.get();
+            std::unique_lock<std::mutex> lock{threads_mutex_};
+            threads_.push_back(std::move(spans));
+        }
+        return *local;
+    }
+
+    static std::string_view SpanName(TraceSpanType type) {
+        switch (type) {
+            case TraceSpanType::kHunt: return "hunt";
+            case TraceSpanType::kReleaseTick: return "release tick";
+            case TraceSpanType::kAttack: return "attack";
+            case TraceSpanType::kCure: return "Cure";
+        }
+        return "unknown";
+    }
+
+    static std::string_view ArgName(TraceSpanType type) {
+        switch (type) {
+            case TraceSpanType::kHunt: return "bee";
+            case TraceSpanType::kReleaseTick: return "released";
+            case TraceSpanType::kAttack: return "succeeded";
+            case TraceSpanType::kCure: return "";
+        }
+        return "";
+    }
+
+    // Trace timestamps are microseconds.
+    static void WriteMicros(std::ostream &out, std::int64_t ns) {
+        char digits[3] = {static_cast<char>('0' + ns / 100 % 10), static_cast<char>('0' + ns / 10 % 10),
+                          static_cast<char>('0' + ns % 10)};
+        out << ns / 1000 << '.';
+        out.write(digits, 3);
+    }
+
+    // Hives are trace processes and tracks are trace threads.
+    static void WriteTrackName(std::ostream &out, int hive, int track) {
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << hive << ",\"tid\":" << track
+            << ",\"args\":{\"name\":\"";
+        if (track == kTraceHiveTrack) {
+            out << "release ticks";
+        } else if (track == kTraceWinnieTrack) {
+            out << "Winnie";
+        } else {
+            out << "bee " << track - kTraceFirstBeeTrack;
+        }
+        out << "\"}},\n";
+    }
+
+public:
+    // Must be called before any other thread records spans.
+    void Start() {
+        epoch_ns_ = LatencyNowNs();
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    void Stop() {
+        enabled_.store(false, std::memory_order_release);
+    }
+
+    // Callers check this first so that a disabled recorder costs one load.
+    bool Enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    void Record(TraceSpanType type, int hive, int track, std::int64_t start_ns, std::int64_t end_ns,
+                std::int32_t arg = 0) {
+        ThreadSpans &spans = Local();
+        if (spans.empty() || spans.back()->size_ == kChunkSpans) {
+            spans.push_back(std::make_unique<Chunk>());
+        }
+        Chunk &chunk = *spans.back();
+        chunk.spans_[chunk.size_++] = TraceSpan{start_ns, end_ns, track, arg, static_cast<std::int16_t>(hive), type};
+    }
+
+    // Writes every recorded span, plus a name for every track used. Only once no thread records.
+    void Write(std::ostream &out) {
+        std::unordered_set<int> hives;
+        std::unordered_set<std::int64_t> tracks;
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        std::unique_lock<std::mutex> lock{threads_mutex_};
+        for (auto &spans: threads_) {
+            for (auto &chunk: *spans) {
+                for (std::size_t i = 0; i < chunk->size_; ++i) {
+                    const TraceSpan &span = chunk->spans_[i];
+                    if (hives.insert(span.hive_).second) {
+                        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << span.hive_
+                            << ",\"args\":{\"name\":\"hive " << span.hive_ << "\"}},\n";
+                    }
+                    if (tracks.insert(static_cast<std::int64_t>(span.hive_) << 32 | span.track_).second) {
+                        WriteTrackName(out, span.hive_, span.track_);
+                    }
+                    out << "{\"name\":\"" << SpanName(span.type_) << "\",\"ph\":\"X\",\"ts\":";
+                    WriteMicros(out, span.start_ns_ - epoch_ns_);
+                    out << ",\"dur\":";
+                    WriteMicros(out, span.end_ns_ - span.start_ns_);
+                    out << ",\"pid\":" << span.hive_ << ",\"tid\":" << span.track_;
+                    if (!ArgName(span.type_).empty()) {
+                        out << ",\"args\":{\"" << ArgName(span.type_) << "\":" << span.arg_ << "}";
+                    }
+                    out << "},\n";
+                }
+            }
+        }
+        // Chrome's trace format allows no trailing comma, so close with an empty metadata event.
+        out << "{\"name\":\"trace_end\",\"ph\":\"M\",\"pid\":0}\n]}\n";
+        out.flush();
+    }
+};
+
+static TraceRecorder trace_recorder;
+
+// Records a span from construction to End or destruction while tracing is enabled.
+class TraceScope {
+    TraceSpanType type_;
+    int hive_;
+    int track_;
+    std::int64_t started_ns_;
+
+public:
+    TraceScope(TraceSpanType type, int hive, int track)
+            : type_(type), hive_(hive), track_(track),
+              started_ns_(trace_recorder.Enabled() ? LatencyNowNs() : 0) {}
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    ~TraceScope() {
+        End();
+    }
+
+    void End(std::int32_t arg = 0) {
+        std::int64_t started_ns = std::exchange(started_ns_, 0);
+        if (started_ns != 0 && trace_recorder.Enabled()) {
+            trace_recorder.Record(type_, hive_, track_, started_ns, LatencyNowNs(), arg);
+        }
+    }
+};
+
+enum class CounterMetric : std::uint8_t {
+    kReleases,
+    kReturns,
+    kAttacks,
+    kSuccessfulAttacks,
+    kCures,
+    kCount,
+};
+
+// What the running engine reports when metrics are scraped.
+struct HiveGauges {
+    std::int64_t bees_in_hive_ = 0;
+    std::int64_t bees_hunting_ = 0;
+    std::int64_t honey_ = 0;
+};
+
+// Live counters for the Prometheus export. Every thread adds to its own cache-line shard with
+// plain relaxed stores, so counting takes no lock and no locked instruction; shards are only
+// summed when scraped. Gauges are read on scrape from whatever engine is running.
+// One instance per process: the thread-local shard belongs to metrics_registry.
+class MetricsRegistry {
+    struct alignas(kCacheLineSize) Shard {
+        std::array<std::atomic<std::uint64_t>, static_cast<std::size_t>(CounterMetric::kCount)> counts_{};
+    };
+
+    std::atomic<bool> enabled_ = false;
+    std::mutex shards_mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::mutex gauges_mutex_;
+    std::function<HiveGauges()> gauges_;
+
+    Shard &Local() {
+        thread_local Shard *local = nullptr;
+        if (local == nullptr) {
+            auto shard = std::make_unique<Shard>();
+            local = shard.get();
+            std::unique_lock<std::mutex> lock{shards_mutex_};
+            shards_.push_back(std::move(shard));
+        }
+        return *local;
+    }
+
+    static void WriteHeader(std::ostream &out, std::string_view name, std::string_view type, std::string_view help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    }
+
+public:
+    void Enable() {
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    bool Enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    void Add(CounterMetric metric, std::uint64_t n = 1) {
+        if (!Enabled()) {
+            return;
+        }
+        auto &count = Local().counts_[static_cast<std::size_t>(metric)];
+        count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t Total(CounterMetric metric) {
+        std::uint64_t total = 0;
+        std::unique_lock<std::mutex> lock{shards_mutex_};
+        for (auto &shard: shards_) {
+            total += shard->counts_[static_cast<std::size_t>(metric)].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // The engine sets its source after Start and clears it before it is destroyed.
+    void SetGaugeSource(std::function<HiveGauges()> gauges) {
+        std::unique_lock<std::mutex> lock{gauges_mutex_};
+        gauges_ = std::move(gauges);
+    }
+
+    // Prometheus text exposition format, version 0.0.4.
+    void WritePrometheus(std::ostream &out) {
+        static constexpr std::tuple<CounterMetric, std::string_view, std::string_view> kCounters[] = {
+                {CounterMetric::kReleases, "abc5_releases_total", "Bees released from a hive."},
+                {CounterMetric::kReturns, "abc5_returns_total", "Bees returned from a hunt."},
+                {CounterMetric::kAttacks, "abc5_attacks_total", "Attacks Winnie attempted."},
+                {CounterMetric::kSuccessfulAttacks, "abc5_successful_attacks_total", "Attacks that ate the honey."},
+                {CounterMetric::kCures, "abc5_cures_total", "Times Winnie had to cure himself."},
+        };
+        for (const auto &[metric, name, help]: kCounters) {
+            WriteHeader(out, name, "counter", help);
+            out << name << " " << Total(metric) << "\n";
+        }
+
+        std::unique_lock<std::mutex> lock{gauges_mutex_};
+        if (gauges_) {
+            HiveGauges gauges = gauges_();
+            WriteHeader(out, "abc5_bees_in_hive", "gauge", "Bees at home.");
+            out << "abc5_bees_in_hive " << gauges.bees_in_hive_ << "\n";
+            WriteHeader(out, "abc5_bees_hunting", "gauge", "Bees out hunting.");
+            out << "abc5_bees_hunting " << gauges.bees_hunting_ << "\n";
+            WriteHeader(out, "abc5_honey", "gauge", "Honey in the hive, summed over hives.");
+            out << "abc5_honey " << gauges.honey_ << "\n";
+        }
+        lock.unlock();
+
+        LatencySummary waits = latency_stats.Merge(LatencyMetric::kHiveMutexWait);
+        WriteHeader(out, "abc5_hive_mutex_waits_total", "counter", "Acquisitions of hive_mutex_ timed.");
+        out << "abc5_hive_mutex_waits_total " << waits.Count() << "\n";
+        WriteHeader(out, "abc5_hive_mutex_wait_seconds", "gauge", "Time spent waiting for hive_mutex_.");
+        for (double quantile: {0.5, 0.99, 0.999}) {
+            out << "abc5_hive_mutex_wait_seconds{quantile=\"" << quantile << "\"} "
+                << static_cast<double>(waits.Percentile(quantile)) * 1e-9 << "\n";
+        }
+        out << "abc5_hive_mutex_wait_seconds{quantile=\"1\"} " << static_cast<double>(waits.Max()) * 1e-9 << "\n";
+    }
+};
+
+static MetricsRegistry metrics_registry;
+
+// Publishes metrics_registry as a node-exporter textfile, rewritten every interval and
+// renamed into place so readers never see half a file, and/or over HTTP on 127.0.0.1:port,
+// from one thread. Any request on the port gets the metrics.
+class MetricsExporter {
+    std::string path_;
+    int listen_fd_ = -1;
+    std::chrono::milliseconds interval_;
+    std::atomic<bool> stop_signal_ = false;
+    std::thread this_thread_;
+
+    void WriteFile() {
+        std::string temp = path_ + ".tmp";
+        {
+            std::ofstream out{temp, std::ios::trunc};
+            metrics_registry.WritePrometheus(out);
+        }
+        std::rename(temp.c_str(), path_.c_str());
+    }
+
+    void Serve() {
+        int client = accept(listen_fd_, nullptr, nullptr);
+        if (client < 0) {
+            return;
+        }
+        // The request itself does not matter; read what has arrived so the client sees a clean close.
+        char request[1024];
+        pollfd readable{client, POLLIN, 0};
+        if (poll(&readable, 1, 100) > 0) {
+            static_cast<void>(read(client, request, sizeof(request)));
+        }
+        std::ostringstream body;
+        metrics_registry.WritePrometheus(body);
+        std::string text = body.str();
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                               std::to_string(text.size()) + "\r\nConnection: close\r\n\r\n" + text;
+        for (std::size_t sent = 0; sent < response.size();) {
+            ssize_t n = write(client, response.data() + sent, response.size() - sent);
+            if (n <= 0) {
+                break;
+            }
+            sent += static_cast<std::size_t>(n);
+        }
+        close(client);
+    }
+
+    void Run() {
+        auto next_write = std::chrono::steady_clock::now();
+        while (!stop_signal_) {
+            auto now = std::chrono::steady_clock::now();
+            if (!path_.empty() && now >= next_write) {
+                WriteFile();
+                next_write = now + interval_;
+            }
+            // Wake at least every 100ms to notice End.
+            auto wait = std::min<std::chrono::milliseconds>(std::chrono::milliseconds{100}, interval_);
+            if (listen_fd_ < 0) {
+                std::this_thread::sleep_for(wait);
+                continue;
+            }
+            pollfd listening{listen_fd_, POLLIN, 0};
+            if (poll(&listening, 1, static_cast<int>(wait.count())) > 0) {
+                Serve();
+            }
+        }
+        if (!path_.empty()) {
+            WriteFile();
+        }
+    }
+
+public:
+    // `port` 0 serves no HTTP endpoint; an empty `path` writes no textfile.
+    MetricsExporter(std::string path, int port, std::chrono::milliseconds interval)
+            : path_(std::move(path)), interval_(interval) {
+        if (port != 0) {
+            listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+            if (listen_fd_ < 0) {
+                throw std::system_error(errno, std::generic_category(), "socket");
+            }
+            int reuse = 1;
+            setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(static_cast<std::uint16_t>(port));
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 ||
+                listen(listen_fd_, 16) < 0) {
+                int error = errno;
+                close(listen_fd_);
+                throw std::system_error(error, std::generic_category(), "metrics port " + std::to_string(port));
+            }
+        }
+        metrics_registry.Enable();
+        this_thread_ = std::thread([this]() { Run(); });
+    }
+
+    MetricsExporter(const MetricsExporter &) = delete;
+    MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+    ~MetricsExporter() {
+        stop_signal_ = true;
+        this_thread_.join();
+        if (listen_fd_ >= 0) {
+            close(listen_fd_);
+        }
+    }
+};
+
+// Wakeup slot for a single waiter on std::atomic wait/notify, i.e. a futex on Linux: four bytes
+// instead of a mutex and a condition variable, and Unpark makes no syscall unless the waiter is
+// actually asleep. An Unpark that comes first is kept, so the next Park returns at once.
+class ParkingSlot {
+    static constexpr std::uint32_t kEmpty = 0;
+    static constexpr std::uint32_t kParked = 1;
+    static constexpr std::uint32_t kNotified = 2;
+
+    std::atomic<std::uint32_t> state_ = kEmpty;
+
+public:
+    // Owner thread only. Returns once Unpark has been called, consuming that call.
+    void Park() {
+        std::uint32_t state = kEmpty;
+        if (state_.compare_exchange_strong(state, kParked)) {
+            do {
+                state_.wait(kParked);
+            } while (state_.load() == kParked);
+        }
+        state_.store(kEmpty, std::memory_order_relaxed);
+    }
+
+    // Everything written before Unpark is visible after the matching Park.
+    void Unpark() {
+        if (state_.exchange(kNotified) == kParked) {
+            state_.notify_one();
+        }
+    }
+};
+
+struct HiveStats {
+    std::uint64_t releases_ = 0;
+    std::uint64_t returns_ = 0;
+    std::uint64_t attacks_ = 0;
+    std::uint64_t successful_attacks_ = 0;
+    std::uint64_t cures_ = 0;
+};
+
+struct Bee {
+    ParkingSlot parking_;
+    std::chrono::milliseconds time_to_hunt_;
+    std::int64_t released_at_ns_ = 0;
+    struct Hive *owner_;
+    std::thread this_thread_;
+    int id_;
+    std::uint32_t trips_ = 0;  // event counter of the bee's hunt time stream
+
+    std::atomic<bool> stop_signal_ = false;
+
+    Bee(Hive *owner, int id)
+            : owner_(owner), id_(id) {}
+
+    Bee(Bee &&other)
+            : time_to_hunt_(other.time_to_hunt_), owner_(other.owner_), this_thread_(std::move(other.this_thread_)),
+              id_(other.id_), trips_(other.trips_) {}
+
+    void Start() {
+        this_thread_ = std::thread([this]() { Run(); });
+    }
+
+    void Hunt(std::chrono::milliseconds time) {
+        time_to_hunt_ = time;
+        released_at_ns_ = LatencyNowNs();
+        parking_.Unpark();
+    }
+
+    void End() {
+        stop_signal_ = true;
+        parking_.Unpark();
+    }
+
+    void Finish() {
+        if (this_thread_.joinable()) {
+            this_thread_.join();
+        }
+    }
+
+    void Run();
+};
+
+struct Hive {
+    TimeDistribution bee_hunting_time_;
+    TimeDistribution bee_release_time_;
+    static constexpr int kMaxHoneyCount = 30;
+    // Winnie's attack succeeds only if fewer bees than this are at home.
+    static constexpr int kMinDefenders = 3;
+
+    std::vector<Bee> all_bees_;
+    // Every bee fits, so pushes never fail. Neither push nor pop takes a lock.
+    BoundedQueue<Bee *> bees_currently_in_hive_;
+    // Bumped on every return; Run waits on it while too few bees are at home.
+    std::atomic<std::uint32_t> returns_ = 0;
+    std::atomic<int> honey_count_ = 0;
+    // Bumped when honey reaches Winnie's threshold, and by End; Winnie waits on it.
+    std::atomic<std::uint32_t> honey_epoch_ = 0;
+    // When honey last reached Winnie's threshold; 0 once Winnie has acted on it.
+    std::atomic<std::int64_t> honey_ready_at_ns_ = 0;
+    // Releases are counted by the hive thread and attacks and cures by Winnie's; returns are
+    // counted in bees_returned_ instead, as bee threads return concurrently.
+    HiveStats stats_;
+    std::atomic<std::uint64_t> bees_returned_ = 0;
+    std::uint32_t release_ticks_ = 0;  // event counter of the release delay stream
+    std::thread this_thread_;
+    int release_batch_ = 1;
+    std::vector<Bee *> release_bees_;
+    RngBatch hunt_draws_;
+
+    std::atomic<bool> stop_signal_ = false;
+
+    Hive(int num_bees, const HiveTimes &times = {})
+            : bee_hunting_time_(times.hunt_), bee_release_time_(times.release_), bees_currently_in_hive_(num_bees) {
+        all_bees_.reserve(num_bees);
+        for (int i = 0; i < num_bees; ++i) {
+            auto &bee = all_bees_.emplace_back(this, i);
+            bees_currently_in_hive_.TryPush(std::addressof(bee));
+        }
+    }
+
+    ~Hive() {
+        Join();
+    }
+
+    // Waits for the hive and bee threads to exit after End.
+    void Join() {
+        for (auto &bee: all_bees_) {
+            bee.Finish();
+        }
+        if (this_thread_.joinable()) {
+            this_thread_.join();
+        }
+    }
+
+    void Start() {
+        for (auto &b: all_bees_) {
+            b.Start();
+        }
+        this_thread_ = std::thread([this]() { Run(); });
+    }
+
+    // Wait-free; may be off by the pushes and pops in flight.
+    int Size() {
+        return static_cast<int>(bees_currently_in_hive_.SizeApprox());
+    }
+
+    // Bees released per Run iteration so that, on average, the whole colony can be out hunting
+    // at once instead of being limited to one release per release delay.
+    static int AutoReleaseBatch(int num_bees, const HiveTimes &times = {}) {
+        return std::max(1, static_cast<int>(num_bees * times.release_.Mean() / times.hunt_.Mean()));
+    }
+
+    // Releases up to `max_bees` bees, always leaving one at home: one claim on the queue and
+    // one batch of hunt times for all of them.
+    void ReleaseBatch(int max_bees) {
+        release_bees_.resize(std::max(0, std::min(max_bees, Size() - 1)));
+        release_bees_.resize(bees_currently_in_hive_.TryPopBatch(release_bees_));
+        hunt_draws_.Clear();
+        for (Bee *bee: release_bees_) {
+            hunt_draws_.Add(bee->id_, bee->trips_++);
+        }
+        bee_hunting_time_.FillAt(RngStream::kBeeHunt, hunt_draws_);
+        stats_.releases_ += release_bees_.size();
+        metrics_registry.Add(CounterMetric::kReleases, release_bees_.size());
+
+        int at_home = Size();
+        for (std::size_t i = 0; i < release_bees_.size(); ++i) {
+            Bee *next = release_bees_[i];
+            int release_ms = hunt_draws_.values_[i];
+            int bee_count = at_home + static_cast<int>(release_bees_.size() - 1 - i);
+            SYNC_LOG(kDebug, "Bee ", next->id_, " is going for a hunt for ", release_ms, "ms. Current bee count: ", bee_count, "\n");
+            if (event_stream.Enabled()) {
+                event_stream.Record(HiveEventType::kBeeReleased, next->id_, honey_count_, bee_count);
+            }
+            next->Hunt(std::chrono::milliseconds{release_ms});
+        }
+    }
+
+    void ReleaseOne() {
+        ReleaseBatch(1);
+    }
+
+    // Honey after `returns` more bees came back: each brings one unit, up to kMaxHoneyCount.
+    static int SaturatingAddHoney(int honey, int returns) {
+        return std::max(honey, std::min(honey + returns, kMaxHoneyCount));
+    }
+
+    // Returns several bees at once: one wakeup for Run and one saturating honey update for the
+    // whole batch. Takes no lock; Winnie is woken only when honey crosses his threshold.
+    void ReturnBatch(std::span<Bee *const> bees);
+
+    void ReturnOne(Bee *bee) {
+        ReturnBatch({&bee, 1});
+    }
+
+    bool TryAttack() {
+        if (Size() < kMinDefenders) {
+            honey_count_ = 0;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    void Run() {
+        while (!stop_signal_) {
+            std::uint32_t seen = returns_.load(std::memory_order_acquire);
+            if (Size() <= 1 && !stop_signal_) {
+                returns_.wait(seen, std::memory_order_acquire);
+                continue;
+            }
+
+            if (stop_signal_) {
+                SYNC_LOG(kInfo, "Shutting down hive\n");
+                return;
+            }
+
+            TraceScope tick{TraceSpanType::kReleaseTick, 0, kTraceHiveTrack};
+            ReleaseBatch(release_batch_);
+            tick.End(static_cast<std::int32_t>(release_bees_.size()));
+
+            int release_delay_ms = bee_release_time_.At(RngStream::kHiveRelease, 0, release_ticks_++);
+            std::this_thread::sleep_for(std::chrono::milliseconds{release_delay_ms});
+        }
+        SYNC_LOG(kInfo, "Shutting down hive\n");
+    }
+
+    void End() {
+        stop_signal_ = true;
+        for (auto &bee: all_bees_) {
+            bee.End();
+        }
+        returns_.fetch_add(1, std::memory_order_release);
+        returns_.notify_all();
+        honey_epoch_.fetch_add(1, std::memory_order_release);
+        honey_epoch_.notify_all();
+    }
+
+    // Valid after Join.
+    HiveStats Stats() const {
+        HiveStats stats = stats_;
+        stats.returns_ = bees_returned_.load();
+        return stats;
+    }
+};
+
+void Bee::Run() {
+    while (!stop_signal_) {
+        parking_.Park();
+
+        if (stop_signal_) {
+            SYNC_LOG(kTrace, "Shutting down bee #", id_, "\n");
+            return;
+        }
+
+        std::int64_t woke_at_ns = LatencyNowNs();
+        latency_stats.Record(LatencyMetric::kReleaseToWake, woke_at_ns - released_at_ns_);
+        std::this_thread::sleep_for(time_to_hunt_);
+        if (trace_recorder.Enabled()) {
+            trace_recorder.Record(TraceSpanType::kHunt, 0, kTraceFirstBeeTrack + id_, released_at_ns_, LatencyNowNs(), id_);
+        }
+        owner_->ReturnOne(this);
+        latency_stats.Record(LatencyMetric::kWakeToReturn, LatencyNowNs() - woke_at_ns);
+    }
+    SYNC_LOG(kTrace, "Shutting down bee #", id_, "\n");
+}
+
+struct Winnie {
+    Hive *hive_;
+    std::thread this_thread_;
+
+    std::atomic<bool> stop_signal_ = false;
+
+    static constexpr int kCureTime = 2000;
+    static constexpr int kAttackHoneyThreshold = 15;
+
+    Winnie(Hive *hive)
+            : hive_(hive) {}
+
+    ~Winnie() {
+        Join();
+    }
+
+    void Join() {
+        if (this_thread_.joinable()) {
+            this_thread_.join();
+        }
+    }
+
+    void Start() {
+        this_thread_ = std::thread([this]() { Run(); });
+    }
+
+    // Reads the hive lock-free: a bee returning meanwhile is not held up.
+    bool Attack() {
+        ++hive_->stats_.attacks_;
+        metrics_registry.Add(CounterMetric::kAttacks);
+        SYNC_LOG(kInfo, "Winnie is trying to attack the hive. Hive bee count is: ", hive_->Size(), "\n");
+        if (event_stream.Enabled()) {
+            event_stream.Record(HiveEventType::kAttackAttempt, HiveEvent::kNoBee, hive_->honey_count_, hive_->Size());
+        }
+        if (!hive_->TryAttack()) {
+            return false;
+        }
+        ++hive_->stats_.successful_attacks_;
+        metrics_registry.Add(CounterMetric::kSuccessfulAttacks);
+        if (event_stream.Enabled()) {
+            event_stream.Record(HiveEventType::kAttackSuccess, HiveEvent::kNoBee, hive_->honey_count_, hive_->Size());
+        }
+        return true;
+    }
+
+    void Cure() {
+        TraceScope span{TraceSpanType::kCure, 0, kTraceWinnieTrack};
+        SYNC_LOG(kInfo, "Winnie is curing himself :(\n");
+        if (event_stream.Enabled()) {
+            event_stream.Record(HiveEventType::kCure, HiveEvent::kNoBee, hive_->honey_count_, hive_->Size());
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds{kCureTime});
+        SYNC_LOG(kInfo, "Winnie is healthy now\n");
+    }
+
+    void Run() {
+        for (;;) {
+            // Load the epoch before checking, so a crossing or End in between ends the wait.
+            std::uint32_t seen = hive_->honey_epoch_.load(std::memory_order_acquire);
+            if (stop_signal_) {
+                break;
+            }
+            if (hive_->honey_count_ < kAttackHoneyThreshold) {
+                hive_->honey_epoch_.wait(seen, std::memory_order_acquire);
+                continue;
+            }
+            if (std::int64_t ready_at = hive_->honey_ready_at_ns_.exchange(0); ready_at != 0) {
+                latency_stats.Record(LatencyMetric::kReturnToWinnie, LatencyNowNs() - ready_at);
+            }
+
+            TraceScope attack{TraceSpanType::kAttack, 0, kTraceWinnieTrack};
+            bool attacked = Attack();
+            attack.End(attacked);
+            if (attacked) {
+                SYNC_LOG(kInfo, "Winnie succesfully attacked the hive and ate all honey\n");
+                continue;
+            } else {
+                ++hive_->stats_.cures_;
+                metrics_registry.Add(CounterMetric::kCures);
+                Cure();
+            }
+        }
+        SYNC_LOG(kInfo, "Shutting down Winnie the pooh\n");
+    }
+
+    void End() {
+        stop_signal_ = true;
+        hive_->honey_epoch_.fetch_add(1, std::memory_order_release);
+        hive_->honey_epoch_.notify_all();
+    }
+};
+
+void Hive::ReturnBatch(std::span<Bee *const> bees) {
+    if (bees.empty()) {
+        return;
+    }
+    for (Bee *bee: bees) {
+        bees_currently_in_hive_.TryPush(bee);
+    }
+    returns_.fetch_add(1, std::memory_order_release);
+    returns_.notify_one();
+    metrics_registry.Add(CounterMetric::kReturns, bees.size());
+    bees_returned_.fetch_add(bees.size(), std::memory_order_relaxed);
+
+    int honey = honey_count_.load();
+    int honey_now;
+    do {
+        honey_now = SaturatingAddHoney(honey, static_cast<int>(bees.size()));
+        if (honey < Winnie::kAttackHoneyThreshold && honey_now >= Winnie::kAttackHoneyThreshold) {
+            // Stamped before the add publishes the crossing: Winnie may act on the honey without
+            // waiting for the epoch, and must find this crossing's stamp when he does.
+            honey_ready_at_ns_.store(LatencyNowNs());
+        }
+    } while (honey_now != honey && !honey_count_.compare_exchange_weak(honey, honey_now));
+    for (std::size_t i = 0; i < bees.size(); ++i) {
+        int honey_after = SaturatingAddHoney(honey, static_cast<int>(i + 1));
+        SYNC_LOG(kDebug, "Bee ", bees[i]->id_, " returned from a hunt. Current honey: ", honey_after, "\n");
+        if (event_stream.Enabled()) {
+            event_stream.Record(HiveEventType::kBeeReturned, bees[i]->id_, honey_after, Size());
+        }
+    }
+    // Exactly one return sees the crossing, so Winnie gets one event per time honey is ready.
+    if (honey < Winnie::kAttackHoneyThreshold && honey_now >= Winnie::kAttackHoneyThreshold) {
+        honey_epoch_.fetch_add(1, std::memory_order_release);
+        honey_epoch_.notify_one();
+    }
+}
+
+class App {
+    Hive hive_;
+    Winnie winnie_;
+
+public:
+    App(int max_bee_count, int release_batch = 1, const HiveTimes &times = {})
+            : hive_(max_bee_count, times), winnie_(&hive_) {
+        hive_.release_batch_ = release_batch;
+    }
+
+    void Start() {
+        hive_.Start();
+        winnie_.Start();
+    }
+
+    void End() {
+        SYNC_LOG(kInfo, "Shutting down the application\n");
+        if (event_stream.Enabled()) {
+            event_stream.Record(HiveEventType::kShutdown, HiveEvent::kNoBee, hive_.honey_count_, hive_.Size());
+        }
+        hive_.End();
+        winnie_.End();
+        hive_.Join();
+        winnie_.Join();
+        latency_stats.Report();
+        sync_logger.Flush();
+    }
+
+    // Lock-free: the queue size and honey_count_ are atomics.
+    HiveGauges Gauges() {
+        auto in_hive = static_cast<std::int64_t>(hive_.Size());
+        return {in_hive, static_cast<std::int64_t>(hive_.all_bees_.size()) - in_hive, hive_.honey_count_.load()};
+    }
+
+    // Valid after End.
+    HiveStats Stats() const {
+        return hive_.Stats();
+    }
+};
+
+struct CacheAlignedDelete {
+    void operator()(void *pointer) const {
+        ::operator delete(pointer, std::align_val_t{kCacheLineSize});
+    }
+};
+
+template<typename T>
+using CacheAlignedArray = std::unique_ptr<T[], CacheAlignedDelete>;
+
+template<typename T>
+CacheAlignedArray<T> MakeCacheAligned(std::size_t count, T value) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    void *storage = ::operator new(std::max<std::size_t>(count, 1) * sizeof(T), std::align_val_t{kCacheLineSize});
+    T *array = static_cast<T *>(storage);
+    std::uninitialized_fill_n(array, count, value);
+    return CacheAlignedArray<T>{array};
+}
+
+// Kernels behind BeeColony::SweepReturns. Each one brings home every bee due at or before
+// `now_ms` (due time reset to kAtHome, at_home set, index appended to `returned` in index
+// order) and returns the minimum due time left in the array.
+using SweepKernel = std::int32_t (*)(std::int32_t *due, std::uint8_t *at_home, int count, std::int32_t now_ms,
+                                     std::vector<int> &returned);
+
+constexpr std::int32_t kSweepAtHome = std::numeric_limits<std::int32_t>::max();
+
+// Scalar sweep over [first, count); also finishes the tails of the vector kernels.
+inline std::int32_t SweepReturnsFrom(int first, std::int32_t *due, std::uint8_t *at_home, int count,
+                                     std::int32_t now_ms, std::vector<int> &returned) {
+    std::int32_t next_due = kSweepAtHome;
+    for (int i = first; i < count; ++i) {
+        if (due[i] <= now_ms) {
+            due[i] = kSweepAtHome;
+            at_home[i] = 1;
+            returned.push_back(i);
+        } else {
+            next_due = std::min(next_due, due[i]);
+        }
+    }
+    return next_due;
+}
+
+inline std::int32_t SweepReturnsScalar(std::int32_t *due, std::uint8_t *at_home, int count, std::int32_t now_ms,
+                                       std::vector<int> &returned) {
+    return SweepReturnsFrom(0, due, at_home, count, now_ms, returned);
+}
+
+#ifdef ABC5_X86_KERNELS
+
+// `due` must be 32 byte aligned.
+__attribute__((target("avx2")))
+inline std::int32_t SweepReturnsAvx2(std::int32_t *due, std::uint8_t *at_home, int count, std::int32_t now_ms,
+                                     std::vector<int> &returned) {
+    const __m256i now = _mm256_set1_epi32(now_ms);
+    const __m256i home = _mm256_set1_epi32(kSweepAtHome);
+    __m256i next_due = home;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        auto *lane = reinterpret_cast<__m256i *>(due + i);
+        __m256i times = _mm256_load_si256(lane);
+        __m256i later = _mm256_cmpgt_epi32(times, now);
+        unsigned due_mask = ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(later))) & 0xffu;
+        if (due_mask != 0) {
+            times = _mm256_blendv_epi8(home, times, later);
+            _mm256_store_si256(lane, times);
+            for (; due_mask != 0; due_mask &= due_mask - 1) {
+                int bee = i + __builtin_ctz(due_mask);
+                at_home[bee] = 1;
+                returned.push_back(bee);
+            }
+        }
+        next_due = _mm256_min_epi32(next_due, times);
+    }
+    __m128i half = _mm_min_epi32(_mm256_castsi256_si128(next_due), _mm256_extracti128_si256(next_due, 1));
+    half = _mm_min_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_min_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    std::int32_t tail_due = SweepReturnsFrom(i, due, at_home, count, now_ms, returned);
+    return std::min(_mm_cvtsi128_si32(half), tail_due);
+}
+
+// `due` must be 16 byte aligned.
+__attribute__((target("sse4.1")))
+inline std::int32_t SweepReturnsSse41(std::int32_t *due, std::uint8_t *at_home, int count, std::int32_t now_ms,
+                                      std::vector<int> &returned) {
+    const __m128i now = _mm_set1_epi32(now_ms);
+    const __m128i home = _mm_set1_epi32(kSweepAtHome);
+    __m128i next_due = home;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        auto *lane = reinterpret_cast<__m128i *>(due + i);
+        __m128i times = _mm_load_si128(lane);
+        __m128i later = _mm_cmpgt_epi32(times, now);
+        unsigned due_mask = ~static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(later))) & 0xfu;
+        if (due_mask != 0) {
+            times = _mm_blendv_epi8(home, times, later);
+            _mm_store_si128(lane, times);
+            for (; due_mask != 0; due_mask &= due_mask - 1) {
+                int bee = i + __builtin_ctz(due_mask);
+                at_home[bee] = 1;
+                returned.push_back(bee);
+            }
+        }
+        next_due = _mm_min_epi32(next_due, times);
+    }
+    next_due = _mm_min_epi32(next_due, _mm_shuffle_epi32(next_due, _MM_SHUFFLE(1, 0, 3, 2)));
+    next_due = _mm_min_epi32(next_due, _mm_shuffle_epi32(next_due, _MM_SHUFFLE(2, 3, 0, 1)));
+    std::int32_t tail_due = SweepReturnsFrom(i, due, at_home, count, now_ms, returned);
+    return std::min(_mm_cvtsi128_si32(next_due), tail_due);
+}
+#endif
+
+struct SweepKernelChoice {
+    SweepKernel kernel_;
+    const char *name_;
+};
+
+// Picked once, from what the CPU we are running on supports.
+inline const SweepKernelChoice &SelectedSweepKernel() {
+    static const SweepKernelChoice choice = []() -> SweepKernelChoice {
+#ifdef ABC5_X86_KERNELS
+        if (__builtin_cpu_supports("avx2")) {
+            return {&SweepReturnsAvx2, "avx2"};
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return {&SweepReturnsSse41, "sse4.1"};
+        }
+#endif
+        return {&SweepReturnsScalar, "scalar"};
+    }();
+    return choice;
+}
+
+// Kernels behind Simulation::ReturnBatch. Each one writes the honey after each of `count`
+// returns that start from `honey`, every return adding one unit up to `cap`:
+// out[i] = min(honey + i + 1, cap).
+using HoneyKernel = void (*)(std::int32_t honey, std::int32_t cap, int count, std::int32_t *out);
+
+// Scalar over [first, count); also finishes the tails of the vector kernels.
+inline void CappedHoneyFrom(int first, std::int32_t honey, std::int32_t cap, int count, std::int32_t *out) {
+    for (int i = first; i < count; ++i) {
+        out[i] = std::min(honey + i + 1, cap);
+    }
+}
+
+inline void CappedHoneyScalar(std::int32_t honey, std::int32_t cap, int count, std::int32_t *out) {
+    CappedHoneyFrom(0, honey, cap, count, out);
+}
+
+#ifdef ABC5_X86_KERNELS
+
+__attribute__((target("avx2")))
+inline void CappedHoneyAvx2(std::int32_t honey, std::int32_t cap, int count, std::int32_t *out) {
+    const __m256i caps = _mm256_set1_epi32(cap);
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i next = _mm256_add_epi32(_mm256_set1_epi32(honey), _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8));
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_min_epi32(next, caps));
+        next = _mm256_add_epi32(next, step);
+    }
+    CappedHoneyFrom(i, honey, cap, count, out);
+}
+
+__attribute__((target("sse4.1")))
+inline void CappedHoneySse41(std::int32_t honey, std::int32_t cap, int count, std::int32_t *out) {
+    const __m128i caps = _mm_set1_epi32(cap);
+    const __m128i step = _mm_set1_epi32(4);
+    __m128i next = _mm_add_epi32(_mm_set1_epi32(honey), _mm_setr_epi32(1, 2, 3, 4));
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_min_epi32(next, caps));
+        next = _mm_add_epi32(next, step);
+    }
+    CappedHoneyFrom(i, honey, cap, count, out);
+}
+#endif
+
+inline HoneyKernel SelectedHoneyKernel() {
+    static const HoneyKernel kernel = []() -> HoneyKernel {
+#ifdef ABC5_X86_KERNELS
+        if (__builtin_cpu_supports("avx2")) {
+            return &CappedHoneyAvx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return &CappedHoneySse41;
+        }
+#endif
+        return &CappedHoneyScalar;
+    }();
+    return kernel;
+}
+
+// Data-oriented bee state: one array per field instead of one object per bee. The hot
+// arrays are all a return sweep touches; per-trip bookkeeping lives in the cold one.
+class BeeColony {
+public:
+    static constexpr std::int32_t kAtHome = kSweepAtHome;
+
+private:
+    int size_;
+
+    // hot
+    CacheAlignedArray<std::int32_t> due_ms_;  // return time, kAtHome while at home
+    CacheAlignedArray<std::uint8_t> at_home_;
+
+    // cold
+    CacheAlignedArray<std::uint32_t> trips_;
+
+public:
+    explicit BeeColony(int size)
+            : size_(size),
+              due_ms_(MakeCacheAligned<std::int32_t>(size, kAtHome)),
+              at_home_(MakeCacheAligned<std::uint8_t>(size, 1)),
+              trips_(MakeCacheAligned<std::uint32_t>(size, 0)) {}
+
+    std::uint32_t Trips(int bee) const {
+        return trips_[bee];
+    }
+
+    void Release(int bee, std::int32_t due_ms) {
+        due_ms_[bee] = due_ms;
+        at_home_[bee] = 0;
+        ++trips_[bee];
+    }
+
+    void Return(int bee) {
+        due_ms_[bee] = kAtHome;
+        at_home_[bee] = 1;
+    }
+
+    // Brings home every bee due at or before `now_ms`, appending their indices in index order.
+    // Returns the earliest due time still pending (kAtHome if none), so a caller never has to
+    // sweep before then.
+    // Vectorized where the CPU allows it, see SelectedSweepKernel.
+    std::int32_t SweepReturns(std::int32_t now_ms, std::vector<int> &returned) {
+        return SelectedSweepKernel().kernel_(due_ms_.get(), at_home_.get(), size_, now_ms, returned);
+    }
+};
+
+// Runs the Hive/Bee/Winnie rules on a virtual clock instead of threads. Every sleep becomes
+// an event scheduled on a priority queue, so hours of hive time take milliseconds. Events at
+// the same instant run in scheduling order and random draws happen in the same order as in
+// the threaded hive, so the run is deterministic and matches its event sequence.
+class Simulation {
+public:
+    // How hunting bees come back: as individual events on the priority queue, or found by a
+    // linear sweep over the colony's due times. Returns due at the same instant are processed
+    // in scheduling order by the former and in bee order, ahead of other events at that instant,
+    // by the latter. The two runs are statistically equivalent but not identical.
+    enum class ReturnScan {
+        kEventQueue,
+        kSweep,
+    };
+
+    // Due times are int32 milliseconds (what the sweep kernels compare), and a bee released at
+    // the end may be due kMaxDrawnTimeMs later; kAtHome must stay above every one of them.
+    static constexpr std::chrono::milliseconds kMaxTime{BeeColony::kAtHome - kMaxDrawnTimeMs - 1};
+
+private:
+    enum class EventType {
+        kReleaseTick,    // Hive::Run wakes up from its release sleep
+        kBeeReturn,      // Bee::Run wakes up from its hunt
+        kWinnieHealthy,  // Winnie::Cure is over
+    };
+
+    struct Event {
+        std::chrono::milliseconds time_;
+        std::uint64_t sequence_;
+        EventType type_;
+        int bee_;
+
+        bool operator>(const Event &other) const {
+            return std::tie(time_, sequence_) > std::tie(other.time_, other.sequence_);
+        }
+    };
+
+    TimeDistribution bee_hunting_time_;
+    TimeDistribution bee_release_time_;
+    std::uint32_t release_ticks_ = 0;
+    int num_bees_;
+    ReturnScan return_scan_;
+    BeeColony colony_;
+    std::int32_t next_due_ms_ = BeeColony::kAtHome;
+    std::vector<int> returned_;
+    std::vector<std::int32_t> honey_after_;
+    int release_batch_;
+    std::vector<int> release_bees_;
+    RngBatch hunt_draws_;
+    std::queue<int> bees_currently_in_hive_;
+    int honey_count_ = 0;
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<>> events_;
+    std::chrono::milliseconds now_{0};
+    std::uint64_t next_sequence_ = 0;
+    bool hive_waiting_ = false;
+    bool winnie_curing_ = false;
+    HiveStats stats_;
+
+    int Size() const {
+        return static_cast<int>(bees_currently_in_hive_.size());
+    }
+
+    void Schedule(std::chrono::milliseconds delay, EventType type, int bee = HiveEvent::kNoBee) {
+        events_.push(Event{now_ + delay, next_sequence_++, type, bee});
+    }
+
+    void Record(HiveEventType type, int bee) {
+        Record(type, bee, honey_count_);
+    }
+
+    void Record(HiveEventType type, int bee, int honey) {
+        Record(type, bee, honey, Size());
+    }
+
+    void Record(HiveEventType type, int bee, int honey, int hive_size) {
+        if (event_stream.Enabled()) {
+            auto time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now_).count();
+            event_stream.Record(HiveEvent{time_ns, type, bee, honey, hive_size});
+        }
+    }
+
+    void ReleaseTick() {
+        if (Size() <= 1) {
+            hive_waiting_ = true;
+            return;
+        }
+        release_bees_.resize(std::min(release_batch_, Size() - 1));
+        hunt_draws_.Clear();
+        for (int &bee: release_bees_) {
+            bee = bees_currently_in_hive_.front();
+            bees_currently_in_hive_.pop();
+            hunt_draws_.Add(bee, colony_.Trips(bee));
+        }
+        bee_hunting_time_.FillAt(RngStream::kBeeHunt, hunt_draws_);
+        int at_home = Size();
+        for (std::size_t i = 0; i < release_bees_.size(); ++i) {
+            int bee = release_bees_[i];
+            int release_ms = hunt_draws_.values_[i];
+            int bee_count = at_home + static_cast<int>(release_bees_.size() - 1 - i);
+            ++stats_.releases_;
+
+            SYNC_LOG(kDebug, "Bee ", bee, " is going for a hunt for ", release_ms, "ms. Current bee count: ", bee_count, "\n");
+            Record(HiveEventType::kBeeReleased, bee, honey_count_, bee_count);
+            auto due_ms = static_cast<std::int32_t>(now_.count() + release_ms);
+            colony_.Release(bee, due_ms);
+            if (return_scan_ == ReturnScan::kSweep) {
+                next_due_ms_ = std::min(next_due_ms_, due_ms);
+            } else {
+                Schedule(std::chrono::milliseconds{release_ms}, EventType::kBeeReturn, bee);
+            }
+        }
+        int release_delay_ms = bee_release_time_.At(RngStream::kHiveRelease, 0, release_ticks_++);
+        Schedule(std::chrono::milliseconds{release_delay_ms}, EventType::kReleaseTick);
+    }
+
+    void ReturnOne(int bee) {
+        bees_currently_in_hive_.push(bee);
+        if (honey_count_ < Hive::kMaxHoneyCount) {
+            ++honey_count_;
+        }
+        ++stats_.returns_;
+        SYNC_LOG(kDebug, "Bee ", bee, " returned from a hunt. Current honey: ", honey_count_, "\n");
+        Record(HiveEventType::kBeeReturned, bee);
+
+        if (hive_waiting_ && Size() > 1) {
+            hive_waiting_ = false;
+            Schedule(std::chrono::milliseconds{0}, EventType::kReleaseTick);
+        }
+        WakeWinnie();
+    }
+
+    // ReturnOne for every bee the sweep brought home, in bee order, with the same outcome. Bees
+    // are taken in runs that end where honey reaches Winnie's threshold, so he still acts
+    // between the same two returns; within a run the capped honey is computed in one go.
+    void ReturnBatch(std::span<const int> bees) {
+        while (!bees.empty()) {
+            // After WakeWinnie, honey is below the threshold unless Winnie is curing.
+            std::size_t run = bees.size();
+            if (!winnie_curing_) {
+                run = std::min<std::size_t>(run, Winnie::kAttackHoneyThreshold - honey_count_);
+            }
+            honey_after_.resize(run);
+            SelectedHoneyKernel()(honey_count_, Hive::kMaxHoneyCount, static_cast<int>(run), honey_after_.data());
+            for (std::size_t i = 0; i < run; ++i) {
+                int bee = bees[i];
+                bees_currently_in_hive_.push(bee);
+                SYNC_LOG(kDebug, "Bee ", bee, " returned from a hunt. Current honey: ", honey_after_[i], "\n");
+                Record(HiveEventType::kBeeReturned, bee, honey_after_[i]);
+                if (hive_waiting_ && Size() > 1) {
+                    hive_waiting_ = false;
+                    Schedule(std::chrono::milliseconds{0}, EventType::kReleaseTick);
+                }
+            }
+            honey_count_ = honey_after_[run - 1];
+            stats_.returns_ += run;
+            bees = bees.subspan(run);
+            WakeWinnie();
+        }
+    }
+
+    // Winnie::Run: attack as long as there is enough honey, cure after a failed attack.
+    void WakeWinnie() {
+        while (!winnie_curing_ && honey_count_ >= Winnie::kAttackHoneyThreshold) {
+            ++stats_.attacks_;
+            SYNC_LOG(kInfo, "Winnie is trying to attack the hive. Hive bee count is: ", Size(), "\n");
+            Record(HiveEventType::kAttackAttempt, HiveEvent::kNoBee);
+            if (Size() < Hive::kMinDefenders) {
+                honey_count_ = 0;
+                ++stats_.successful_attacks_;
+                Record(HiveEventType::kAttackSuccess, HiveEvent::kNoBee);
+                SYNC_LOG(kInfo, "Winnie succesfully attacked the hive and ate all honey\n");
+            } else {
+                ++stats_.cures_;
+                winnie_curing_ = true;
+                SYNC_LOG(kInfo, "Winnie is curing himself :(\n");
+                Record(HiveEventType::kCure, HiveEvent::kNoBee);
+                Schedule(std::chrono::milliseconds{Winnie::kCureTime}, EventType::kWinnieHealthy);
+            }
+        }
+    }
+
+public:
+    explicit Simulation(int num_bees, ReturnScan return_scan = ReturnScan::kEventQueue, int release_batch = 1,
+                        const HiveTimes &times = {})
+            : bee_hunting_time_(times.hunt_), bee_release_time_(times.release_), num_bees_(num_bees), return_scan_(return_scan), colony_(num_bees), release_batch_(release_batch) {
+        for (int i = 0; i < num_bees; ++i) {
+            bees_currently_in_hive_.push(i);
+        }
+    }
+
+    std::chrono::milliseconds Now() const {
+        return now_;
+    }
+
+    // Advances the virtual clock by `duration`, then shuts down like App::End. The clock may not
+    // pass kMaxTime (about 24 days).
+    HiveStats Run(std::chrono::milliseconds duration) {
+        if (duration.count() < 0 || duration > kMaxTime - now_) {
+            throw std::out_of_range("simulated time beyond " + std::to_string(kMaxTime.count()) + "ms");
+        }
+        if (events_.empty()) {
+            Schedule(std::chrono::milliseconds{0}, EventType::kReleaseTick);
+        }
+        const auto end = now_ + duration;
+        for (;;) {
+            auto next_event = events_.empty() ? std::chrono::milliseconds::max() : events_.top().time_;
+            auto next_return = std::chrono::milliseconds{next_due_ms_};
+            if (std::min(next_event, next_return) > end) {
+                break;
+            }
+            if (next_return <= next_event) {
+                now_ = next_return;
+                returned_.clear();
+                next_due_ms_ = colony_.SweepReturns(static_cast<std::int32_t>(now_.count()), returned_);
+                ReturnBatch(returned_);
+                continue;
+            }
+
+            Event event = events_.top();
+            events_.pop();
+            now_ = event.time_;
+            switch (event.type_) {
+                case EventType::kReleaseTick:
+                    ReleaseTick();
+                    break;
+                case EventType::kBeeReturn:
+                    colony_.Return(event.bee_);
+                    ReturnOne(event.bee_);
+                    break;
+                case EventType::kWinnieHealthy:
+                    winnie_curing_ = false;
+                    SYNC_LOG(kInfo, "Winnie is healthy now\n");
+                    WakeWinnie();
+                    break;
+            }
+        }
+        now_ = end;
+
+        SYNC_LOG(kInfo, "Shutting down the application\n");
+        Record(HiveEventType::kShutdown, HiveEvent::kNoBee);
+        SYNC_LOG(kInfo, "Shutting down hive\n");
+        for (int i = 0; i < num_bees_; ++i) {
+            SYNC_LOG(kTrace, "Shutting down bee #", i, "\n");
+        }
+        SYNC_LOG(kInfo, "Shutting down Winnie the pooh\n");
+        return stats_;
+    }
+};
+
+// Coroutine that starts suspended and frees its own frame when it returns.
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// Intrusive timer for TimerWheel; typically lives inside the awaiter of a sleeping coroutine.
+struct TimerNode {
+    TimerNode *prev_ = nullptr;
+    TimerNode *next_ = nullptr;
+    std::uint64_t expiry_ = 0;  // in wheel ticks
+    std::coroutine_handle<> waiter_;
+
+    bool Linked() const {
+        return next_ != nullptr;
+    }
+};
+
+// Hierarchical timing wheel: kLevels levels of kSlots slots, each level kSlots times coarser
+// than the one below. Insert and Cancel are O(1) list operations; timers in upper levels are
+// cascaded down when the lower level wraps. Not thread-safe.
+class TimerWheel {
+    static constexpr int kLevels = 4;
+    static constexpr int kSlotBits = 8;
+    static constexpr std::uint64_t kSlots = std::uint64_t{1} << kSlotBits;
+    static constexpr std::uint64_t kSlotMask = kSlots - 1;
+    static constexpr std::uint64_t kMaxDelay = (std::uint64_t{1} << (kSlotBits * kLevels)) - 1;
+
+    // Slot heads are sentinels of circular doubly-linked lists.
+    std::array<std::array<TimerNode, kSlots>, kLevels> slots_;
+    std::uint64_t current_;
+    std::size_t size_ = 0;
+
+    static void Unlink(TimerNode &node) {
+        node.prev_->next_ = node.next_;
+        node.next_->prev_ = node.prev_;
+        node.prev_ = node.next_ = nullptr;
+    }
+
+    // Expects current_ <= node.expiry_ <= current_ + kMaxDelay.
+    void Place(TimerNode &node) {
+        std::uint64_t delta = node.expiry_ - current_;
+        int level = 0;
+        while (level + 1 < kLevels && delta >= (std::uint64_t{1} << (kSlotBits * (level + 1)))) {
+            ++level;
+        }
+        TimerNode &head = slots_[level][(node.expiry_ >> (kSlotBits * level)) & kSlotMask];
+        node.prev_ = head.prev_;
+        node.next_ = &head;
+        head.prev_->next_ = &node;
+        head.prev_ = &node;
+    }
+
+    template<typename Fire>
+    void FireSlot(TimerNode &head, Fire &fire) {
+        while (head.next_ != &head) {
+            TimerNode &node = *head.next_;
+            Unlink(node);
+            --size_;
+            // The owner may free the node as soon as it is fired.
+            fire(node);
+        }
+    }
+
+    void Cascade(int level) {
+        TimerNode &head = slots_[level][(current_ >> (kSlotBits * level)) & kSlotMask];
+        while (head.next_ != &head) {
+            TimerNode &node = *head.next_;
+            Unlink(node);
+            Place(node);
+        }
+    }
+
+public:
+    explicit TimerWheel(std::uint64_t now = 0)
+            : current_(now) {
+        for (auto &level: slots_) {
+            for (auto &head: level) {
+                head.prev_ = head.next_ = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    std::uint64_t Current() const {
+        return current_;
+    }
+
+    // Timers that are already due fire on the next tick.
+    void Insert(TimerNode &node) {
+        node.expiry_ = std::clamp(node.expiry_, current_ + 1, current_ + kMaxDelay);
+        Place(node);
+        ++size_;
+    }
+
+    void Cancel(TimerNode &node) {
+        if (node.Linked()) {
+            Unlink(node);
+            --size_;
+        }
+    }
+
+    // Moves the wheel to tick `now`, calling fire(node) for every timer that expired.
+    template<typename Fire>
+    void Advance(std::uint64_t now, Fire &&fire) {
+        if (size_ == 0) {
+            current_ = std::max(current_, now);
+            return;
+        }
+        while (current_ < now && size_ > 0) {
+            ++current_;
+            for (int level = kLevels - 1; level > 0; --level) {
+                if ((current_ & ((std::uint64_t{1} << (kSlotBits * level)) - 1)) == 0) {
+                    Cascade(level);
+                }
+            }
+            FireSlot(slots_[0][current_ & kSlotMask], fire);
+        }
+        current_ = std::max(current_, now);
+    }
+
+    template<typename Fire>
+    void ExpireAll(Fire &&fire) {
+        for (auto &level: slots_) {
+            for (auto &head: level) {
+                FireSlot(head, fire);
+            }
+        }
+    }
+
+    // Ticks until Advance has something to do: the next due timer or the next cascade.
+    std::uint64_t TicksUntilNext() const {
+        std::uint64_t to_cascade = kSlots - (current_ & kSlotMask);
+        for (std::uint64_t delta = 1; delta < to_cascade; ++delta) {
+            const TimerNode &head = slots_[0][(current_ + delta) & kSlotMask];
+            if (head.next_ != &head) {
+                return delta;
+            }
+        }
+        return to_cascade;
+    }
+};
+
+// Small fixed pool of workers resuming ready coroutines, plus one timer thread that turns
+// sleeps into deadlines instead of blocked threads.
+class CoroScheduler {
+    std::mutex run_mutex_;
+    std::condition_variable run_condition_;
+    std::deque<std::coroutine_handle<>> ready_;
+    std::vector<std::thread> workers_;
+
+    // One wheel tick is one millisecond since epoch_.
+    const std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+    std::mutex timer_mutex_;
+    std::condition_variable timer_condition_;
+    TimerWheel timers_;
+    std::uint64_t wake_tick_ = 0;
+    bool expire_all_ = false;
+    std::thread timer_thread_;
+
+    std::atomic<bool> stop_signal_ = false;
+
+    std::uint64_t NowTick() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    void Work() {
+        std::unique_lock<std::mutex> lock{run_mutex_};
+        for (;;) {
+            run_condition_.wait(lock, [this]() { return !ready_.empty() || stop_signal_; });
+            if (ready_.empty()) {
+                return;
+            }
+            std::coroutine_handle<> next = ready_.front();
+            ready_.pop_front();
+            lock.unlock();
+            next.resume();
+            lock.lock();
+        }
+    }
+
+    void RunTimers() {
+        auto fire = [this](TimerNode &node) { Post(node.waiter_); };
+        std::unique_lock<std::mutex> lock{timer_mutex_};
+        while (!stop_signal_) {
+            if (expire_all_) {
+                timers_.ExpireAll(fire);
+            } else {
+                timers_.Advance(NowTick(), fire);
+            }
+            if (timers_.Empty()) {
+                wake_tick_ = std::numeric_limits<std::uint64_t>::max();
+                timer_condition_.wait(lock);
+            } else {
+                wake_tick_ = timers_.Current() + timers_.TicksUntilNext();
+                timer_condition_.wait_until(lock, epoch_ + std::chrono::milliseconds{wake_tick_});
+            }
+        }
+    }
+
+    // Returns false if the sleep should not happen at all.
+    bool AddTimer(std::chrono::milliseconds delay, TimerNode &node) {
+        std::unique_lock<std::mutex> lock{timer_mutex_};
+        if (expire_all_) {
+            return false;
+        }
+        // Rounded up, so a sleep never ends early.
+        node.expiry_ = NowTick() + delay.count() + 1;
+        timers_.Insert(node);
+        if (node.expiry_ < wake_tick_) {
+            timer_condition_.notify_one();
+        }
+        return true;
+    }
+
+public:
+    explicit CoroScheduler(int num_workers) {
+        for (int i = 0; i < num_workers; ++i) {
+            workers_.emplace_back([this]() { Work(); });
+        }
+        timer_thread_ = std::thread([this]() { RunTimers(); });
+    }
+
+    // All coroutines must have finished by now.
+    ~CoroScheduler() {
+        stop_signal_ = true;
+        {
+            std::unique_lock<std::mutex> lock{run_mutex_};
+        }
+        run_condition_.notify_all();
+        {
+            std::unique_lock<std::mutex> lock{timer_mutex_};
+        }
+        timer_condition_.notify_all();
+        for (auto &worker: workers_) {
+            worker.join();
+        }
+        timer_thread_.join();
+    }
+
+    void Post(std::coroutine_handle<> handle) {
+        {
+            std::unique_lock<std::mutex> lock{run_mutex_};
+            ready_.push_back(handle);
+        }
+        run_condition_.notify_one();
+    }
+
+    // One run queue acquisition for the whole batch, and no more wakeups than workers.
+    void PostBatch(std::span<const std::coroutine_handle<>> handles) {
+        {
+            std::unique_lock<std::mutex> lock{run_mutex_};
+            ready_.insert(ready_.end(), handles.begin(), handles.end());
+        }
+        if (handles.size() >= workers_.size()) {
+            run_condition_.notify_all();
+        } else {
+            for (std::size_t i = 0; i < handles.size(); ++i) {
+                run_condition_.notify_one();
+            }
+        }
+    }
+
+    // Fires every pending sleep now and makes later sleeps return immediately; used on shutdown.
+    void ExpireTimers() {
+        {
+            std::unique_lock<std::mutex> lock{timer_mutex_};
+            expire_all_ = true;
+        }
+        timer_condition_.notify_one();
+    }
+
+    auto SleepFor(std::chrono::milliseconds delay) {
+        struct Awaiter {
+            CoroScheduler *scheduler_;
+            std::chrono::milliseconds delay_;
+            TimerNode node_;
+
+            bool await_ready() {
+                return delay_.count() <= 0;
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle) {
+                node_.waiter_ = handle;
+                return scheduler_->AddTimer(delay_, node_);
+            }
+
+            void await_resume() {}
+        };
+        return Awaiter{this, delay, {}};
+    }
+};
+
+// Suspends the awaiting coroutine into `slot` unless `ready()` already holds. Both are
+// checked and stored under `mutex`, which is what wakers hold when they take the slot.
+template<typename Ready>
+struct ParkUnless {
+    HotMutex &mutex_;
+    std::coroutine_handle<> &slot_;
+    Ready ready_;
+
+    bool await_ready() {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        auto lock = LockHot(mutex_);
+        if (ready_()) {
+            return false;
+        }
+        slot_ = handle;
+        return true;
+    }
+
+    void await_resume() {}
+};
+
+template<typename Ready>
+ParkUnless(HotMutex &, std::coroutine_handle<> &, Ready) -> ParkUnless<Ready>;
+
+struct CoroBee {
+    int id_;
+    std::uint32_t trips_ = 0;
+    std::chrono::milliseconds time_to_hunt_{0};
+    std::int64_t released_at_ns_ = 0;
+    // Suspended bee coroutine while the bee is at home.
+    std::coroutine_handle<> handle_;
+
+    explicit CoroBee(int id)
+            : id_(id) {}
+};
+
+// The hive, its bees and Winnie as coroutines on a CoroScheduler. A bee at home is nothing
+// but its suspended frame sitting in the hive queue; releasing it means posting its handle.
+class CoroHive {
+    CoroScheduler *scheduler_;
+    TimeDistribution bee_hunting_time_;
+    TimeDistribution bee_release_time_;
+    std::uint32_t release_ticks_ = 0;
+
+    std::vector<CoroBee> all_bees_;
+    HotMutex hive_mutex_{"CoroHive::hive_mutex_"};
+    std::queue<CoroBee *> bees_currently_in_hive_;
+    int honey_count_ = 0;
+    HiveStats stats_;  // under hive_mutex_
+    std::coroutine_handle<> hive_waiter_;
+    std::coroutine_handle<> winnie_waiter_;
+    std::atomic<bool> stop_signal_ = false;
+    int release_batch_;
+    std::vector<CoroBee *> release_bees_;
+    RngBatch hunt_draws_;
+    std::vector<std::coroutine_handle<>> release_handles_;
+
+    std::mutex done_mutex_;
+    std::condition_variable done_condition_;
+    int live_tasks_ = 0;
+    bool started_ = false;
+
+    int Size() const {
+        return static_cast<int>(bees_currently_in_hive_.size());
+    }
+
+    void TaskFinished() {
+        std::unique_lock<std::mutex> lock{done_mutex_};
+        if (--live_tasks_ == 0) {
+            done_condition_.notify_all();
+        }
+    }
+
+    void Spawn(DetachedTask task) {
+        {
+            std::unique_lock<std::mutex> lock{done_mutex_};
+            ++live_tasks_;
+        }
+        scheduler_->Post(task.handle_);
+    }
+
+    void Record(HiveEventType type, int bee) {
+        Record(type, bee, Size());
+    }
+
+    void Record(HiveEventType type, int bee, int hive_size) {
+        if (event_stream.Enabled()) {
+            event_stream.Record(type, bee, honey_count_, hive_size);
+        }
+    }
+
+    // Pushes the bee back and suspends it until the hive releases it again.
+    auto ReturnOne(CoroBee &bee) {
+        struct Awaiter {
+            CoroHive *hive_;
+            CoroBee &bee_;
+
+            bool await_ready() {
+                return false;
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle) {
+                std::coroutine_handle<> wake_hive, wake_winnie;
+                CoroScheduler *scheduler = hive_->scheduler_;
+                {
+                    auto lock = LockRecordingWait(hive_->hive_mutex_, LatencyMetric::kHiveMutexWait);
+                    if (hive_->stop_signal_) {
+                        return false;
+                    }
+                    bee_.handle_ = handle;
+                    hive_->bees_currently_in_hive_.push(&bee_);
+                    ++hive_->stats_.returns_;
+                    metrics_registry.Add(CounterMetric::kReturns);
+                    if (hive_->honey_count_ < Hive::kMaxHoneyCount) {
+                        ++hive_->honey_count_;
+                    }
+                    SYNC_LOG(kDebug, "Bee ", bee_.id_, " returned from a hunt. Current honey: ", hive_->honey_count_, "\n");
+                    hive_->Record(HiveEventType::kBeeReturned, bee_.id_);
+                    if (hive_->hive_waiter_ && hive_->Size() > 1) {
+                        wake_hive = std::exchange(hive_->hive_waiter_, {});
+                    }
+                    if (hive_->winnie_waiter_ && hive_->honey_count_ >= Winnie::kAttackHoneyThreshold) {
+                        wake_winnie = std::exchange(hive_->winnie_waiter_, {});
+                    }
+                }
+                // The bee may already be running again elsewhere; only locals from here on.
+                if (wake_hive) {
+                    scheduler->Post(wake_hive);
+                }
+                if (wake_winnie) {
+                    scheduler->Post(wake_winnie);
+                }
+                return true;
+            }
+
+            void await_resume() {}
+        };
+        return Awaiter{this, bee};
+    }
+
+    // Bee::Run. The coroutine starts suspended and parked in the hive queue.
+    DetachedTask BeeRun(CoroBee &bee) {
+        for (;;) {
+            if (stop_signal_) {
+                break;
+            }
+            std::int64_t woke_at_ns = LatencyNowNs();
+            latency_stats.Record(LatencyMetric::kReleaseToWake, woke_at_ns - bee.released_at_ns_);
+            co_await scheduler_->SleepFor(bee.time_to_hunt_);
+            std::int64_t returning_at_ns = LatencyNowNs();
+            if (trace_recorder.Enabled()) {
+                trace_recorder.Record(TraceSpanType::kHunt, 0, kTraceFirstBeeTrack + bee.id_, bee.released_at_ns_,
+                                      returning_at_ns, bee.id_);
+            }
+            // Recorded before the return: once it is awaited the bee sleeps until its next release.
+            latency_stats.Record(LatencyMetric::kWakeToReturn, returning_at_ns - woke_at_ns);
+            co_await ReturnOne(bee);
+        }
+        SYNC_LOG(kTrace, "Shutting down bee #", bee.id_, "\n");
+        TaskFinished();
+    }
+
+    // Hive::ReleaseBatch: one hive_mutex_ acquisition, one batch of hunt times and one post
+    // for all released bees. Only HiveRun calls this, so the scratch vectors are its own.
+    void ReleaseBatch(int max_bees) {
+        release_handles_.clear();
+        {
+            auto lock = LockRecordingWait(hive_mutex_, LatencyMetric::kHiveMutexWait);
+            release_bees_.resize(std::max(0, std::min(max_bees, Size() - 1)));
+            stats_.releases_ += release_bees_.size();
+            metrics_registry.Add(CounterMetric::kReleases, release_bees_.size());
+            hunt_draws_.Clear();
+            for (CoroBee *&bee: release_bees_) {
+                bee = bees_currently_in_hive_.front();
+                bees_currently_in_hive_.pop();
+                hunt_draws_.Add(bee->id_, bee->trips_++);
+            }
+            bee_hunting_time_.FillAt(RngStream::kBeeHunt, hunt_draws_);
+            int at_home = Size();
+            for (std::size_t i = 0; i < release_bees_.size(); ++i) {
+                CoroBee *next = release_bees_[i];
+                int release_ms = hunt_draws_.values_[i];
+                int bee_count = at_home + static_cast<int>(release_bees_.size() - 1 - i);
+                SYNC_LOG(kDebug, "Bee ", next->id_, " is going for a hunt for ", release_ms, "ms. Current bee count: ", bee_count, "\n");
+                Record(HiveEventType::kBeeReleased, next->id_, bee_count);
+                next->time_to_hunt_ = std::chrono::milliseconds{release_ms};
+                next->released_at_ns_ = LatencyNowNs();
+                release_handles_.push_back(next->handle_);
+            }
+        }
+        scheduler_->PostBatch(release_handles_);
+    }
+
+    // Hive::Run
+    DetachedTask HiveRun() {
+        for (;;) {
+            co_await ParkUnless{hive_mutex_, hive_waiter_, [this]() { return Size() > 1 || stop_signal_; }};
+            if (stop_signal_) {
+                break;
+            }
+            TraceScope tick{TraceSpanType::kReleaseTick, 0, kTraceHiveTrack};
+            ReleaseBatch(release_batch_);
+            tick.End(static_cast<std::int32_t>(release_handles_.size()));
+            int release_delay_ms = bee_release_time_.At(RngStream::kHiveRelease, 0, release_ticks_++);
+            co_await scheduler_->SleepFor(std::chrono::milliseconds{release_delay_ms});
+        }
+        SYNC_LOG(kInfo, "Shutting down hive\n");
+        TaskFinished();
+    }
+
+    // Winnie::Run
+    DetachedTask WinnieRun() {
+        for (;;) {
+            co_await ParkUnless{hive_mutex_, winnie_waiter_, [this]() {
+                return honey_count_ >= Winnie::kAttackHoneyThreshold || stop_signal_;
+            }};
+            bool attacked;
+            {
+                auto lock = LockHot(hive_mutex_);
+                if (stop_signal_) {
+                    break;
+                }
+                TraceScope attack{TraceSpanType::kAttack, 0, kTraceWinnieTrack};
+                SYNC_LOG(kInfo, "Winnie is trying to attack the hive. Hive bee count is: ", Size(), "\n");
+                Record(HiveEventType::kAttackAttempt, HiveEvent::kNoBee);
+                ++stats_.attacks_;
+                metrics_registry.Add(CounterMetric::kAttacks);
+                attacked = Size() < Hive::kMinDefenders;
+                if (attacked) {
+                    honey_count_ = 0;
+                    ++stats_.successful_attacks_;
+                    metrics_registry.Add(CounterMetric::kSuccessfulAttacks);
+                    Record(HiveEventType::kAttackSuccess, HiveEvent::kNoBee);
+                } else {
+                    ++stats_.cures_;
+                    metrics_registry.Add(CounterMetric::kCures);
+                    Record(HiveEventType::kCure, HiveEvent::kNoBee);
+                }
+                attack.End(attacked);
+            }
+            if (attacked) {
+                SYNC_LOG(kInfo, "Winnie succesfully attacked the hive and ate all honey\n");
+            } else {
+                SYNC_LOG(kInfo, "Winnie is curing himself :(\n");
+                TraceScope cure{TraceSpanType::kCure, 0, kTraceWinnieTrack};
+                co_await scheduler_->SleepFor(std::chrono::milliseconds{Winnie::kCureTime});
+                SYNC_LOG(kInfo, "Winnie is healthy now\n");
+            }
+        }
+        SYNC_LOG(kInfo, "Shutting down Winnie the pooh\n");
+        TaskFinished();
+    }
+
+public:
+    CoroHive(CoroScheduler *scheduler, int num_bees, int release_batch = 1, const HiveTimes &times = {})
+            : scheduler_(scheduler), bee_hunting_time_(times.hunt_), bee_release_time_(times.release_),
+              release_batch_(release_batch) {
+        all_bees_.reserve(num_bees);
+        for (int i = 0; i < num_bees; ++i) {
+            all_bees_.emplace_back(i);
+        }
+    }
+
+    ~CoroHive() {
+        End();
+    }
+
+    void Start() {
+        started_ = true;
+        live_tasks_ = static_cast<int>(all_bees_.size());
+        for (auto &bee: all_bees_) {
+            bee.handle_ = BeeRun(bee).handle_;
+            bees_currently_in_hive_.push(&bee);
+        }
+        Spawn(HiveRun());
+        Spawn(WinnieRun());
+    }
+
+    // Stops every coroutine and waits until all of them have finished.
+    void End() {
+        if (!std::exchange(started_, false)) {
+            return;
+        }
+        std::vector<std::coroutine_handle<>> wake;
+        {
+            auto lock = LockHot(hive_mutex_);
+            SYNC_LOG(kInfo, "Shutting down the application\n");
+            Record(HiveEventType::kShutdown, HiveEvent::kNoBee);
+            stop_signal_ = true;
+            for (auto *slot: {&hive_waiter_, &winnie_waiter_}) {
+                if (*slot) {
+                    wake.push_back(std::exchange(*slot, {}));
+                }
+            }
+            for (; !bees_currently_in_hive_.empty(); bees_currently_in_hive_.pop()) {
+                wake.push_back(bees_currently_in_hive_.front()->handle_);
+            }
+        }
+        scheduler_->ExpireTimers();
+        for (auto handle: wake) {
+            scheduler_->Post(handle);
+        }
+        std::unique_lock<std::mutex> lock{done_mutex_};
+        done_condition_.wait(lock, [this]() { return live_tasks_ == 0; });
+        latency_stats.Report();
+        sync_logger.Flush();
+    }
+
+    // Takes hive_mutex_, which the coroutines hold for every return and release anyway.
+    HiveGauges Gauges() {
+        auto lock = LockHot(hive_mutex_);
+        auto in_hive = static_cast<std::int64_t>(Size());
+        return {in_hive, static_cast<std::int64_t>(all_bees_.size()) - in_hive, honey_count_};
+    }
+
+    // Valid after End.
+    const HiveStats &Stats() const {
+        return stats_;
+    }
+};
+
+// NUMA layout read from /sys/devices/system/node, restricted to the CPUs this process may run on.
+// Machines without that directory are one node holding every allowed CPU.
+class CpuTopology {
+    std::vector<std::vector<int>> node_cpus_;
+    std::vector<int> cpu_node_;
+
+    // Parses a kernel cpulist such as "0-3,8-11".
+    static std::vector<int> ParseCpuList(std::string_view list) {
+        std::vector<int> cpus;
+        while (!list.empty()) {
+            std::size_t comma = std::min(list.find(','), list.size());
+            std::string_view range = list.substr(0, comma);
+            list.remove_prefix(std::min(comma + 1, list.size()));
+            int first = 0, last = -1;
+            auto [end, ec] = std::from_chars(range.data(), range.data() + range.size(), first);
+            if (ec != std::errc{}) {
+                continue;
+            }
+            last = first;
+            if (end != range.data() + range.size() && *end == '-') {
+                std::from_chars(end + 1, range.data() + range.size(), last);
+            }
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+public:
+    static CpuTopology Detect() {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+
+        CpuTopology topology;
+        for (int node = 0;; ++node) {
+            std::ifstream in{"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"};
+            if (!in) {
+                break;
+            }
+            std::string list;
+            std::getline(in, list);
+            std::vector<int> cpus;
+            for (int cpu: ParseCpuList(list)) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) {
+                topology.node_cpus_.push_back(std::move(cpus));
+            }
+        }
+        if (topology.node_cpus_.empty()) {
+            topology.node_cpus_.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    topology.node_cpus_.back().push_back(cpu);
+                }
+            }
+        }
+        for (std::size_t node = 0; node < topology.node_cpus_.size(); ++node) {
+            for (int cpu: topology.node_cpus_[node]) {
+                topology.cpu_node_.resize(std::max<std::size_t>(topology.cpu_node_.size(), cpu + 1), 0);
+                topology.cpu_node_[cpu] = static_cast<int>(node);
+            }
+        }
+        return topology;
+    }
+
+    int Nodes() const {
+        return static_cast<int>(node_cpus_.size());
+    }
+
+    const std::vector<int> &CpusOf(int node) const {
+        return node_cpus_[node];
+    }
+
+    int NodeOf(int cpu) const {
+        return cpu >= 0 && cpu < static_cast<int>(cpu_node_.size()) ? cpu_node_[cpu] : 0;
+    }
+
+    // Node of the CPU the calling thread is on right now.
+    int CurrentNode() const {
+        return NodeOf(sched_getcpu());
+    }
+
+    // CPU for the index-th pinned thread: nodes round-robin, then cores within each node.
+    int CpuFor(int index) const {
+        const auto &cpus = node_cpus_[index % Nodes()];
+        return cpus[(index / Nodes()) % cpus.size()];
+    }
+};
+
+// Restricts the calling thread to `cpus`; allocations it touches first land on their node.
+void PinThisThread(std::span<const int> cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu: cpus) {
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        throw std::system_error(errno, std::generic_category(), "sched_setaffinity");
+    }
+}
+
+// Chase-Lev work-stealing deque of fixed capacity: the owner pushes and pops at the bottom,
+// any other thread steals from the top. T must be trivially copyable (bee pointers here).
+template<typename T>
+class WorkStealingDeque {
+    std::unique_ptr<std::atomic<T>[]> buffer_;
+    std::int64_t mask_;
+
+    alignas(kCacheLineSize) std::atomic<std::int64_t> top_ = 0;
+    alignas(kCacheLineSize) std::atomic<std::int64_t> bottom_ = 0;
+
+public:
+    explicit WorkStealingDeque(std::size_t capacity) {
+        if (capacity > std::size_t{1} << 63) {
+            throw std::length_error("WorkStealingDeque capacity above 2^63");
+        }
+        std::size_t size = std::bit_ceil(std::max<std::size_t>(capacity, 2));
+        buffer_ = std::make_unique<std::atomic<T>[]>(size);
+        mask_ = static_cast<std::int64_t>(size - 1);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque &) = delete;
+    WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+    // Owner only. Returns false when full.
+    bool PushBottom(T value) {
+        std::int64_t bottom = bottom_.load(std::memory_order_relaxed);
+        std::int64_t top = top_.load(std::memory_order_acquire);
+        if (bottom - top > mask_) {
+            return false;
+        }
+        buffer_[bottom & mask_].store(value, std::memory_order_relaxed);
+        bottom_.store(bottom + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Owner only. Races thieves for the last element through top_.
+    bool PopBottom(T &out) {
+        std::int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+        bottom_.store(bottom, std::memory_order_seq_cst);
+        std::int64_t top = top_.load(std::memory_order_seq_cst);
+        if (top > bottom) {
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+            return false;
+        }
+        out = buffer_[bottom & mask_].load(std::memory_order_relaxed);
+        if (top == bottom) {
+            bool won = top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    bool Steal(T &out) {
+        std::int64_t top = top_.load(std::memory_order_seq_cst);
+        std::int64_t bottom = bottom_.load(std::memory_order_seq_cst);
+        if (top >= bottom) {
+            return false;
+        }
+        out = buffer_[top & mask_].load(std::memory_order_relaxed);
+        return top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    // Approximate when called from a thread other than the owner.
+    int SizeApprox() const {
+        std::int64_t size = bottom_.load(std::memory_order_relaxed) - top_.load(std::memory_order_relaxed);
+        return static_cast<int>(std::max<std::int64_t>(size, 0));
     }
 };
 
-static SynchronizedOut sync_logger{std::cout};
-constexpr auto sync_log = [](auto &&... args) {
-    sync_logger.Log(std::forward<decltype(args)>(args)...);
+// A hunting bee is its own timer: it sits in the wheel of whichever hive released it and,
+// when it fires, returns to that hive.
+struct ColonyBee : TimerNode {
+    int id_;
+    int home_node_;  // where the bee was allocated
+    std::uint32_t trips_ = 0;
+    std::int64_t released_at_ns_ = 0;  // only while tracing
+
+    ColonyBee(int id, int home_node)
+            : id_(id), home_node_(home_node) {}
 };
 
-template<int Min, int Max>
-struct RNGSettings {
-    std::uniform_int_distribution<> distribution_{Min, Max};
+// One shard of the Colony: its own bee deque, RNG, honey counter and timer wheel, driven by
+// one thread. Nothing here is shared with other hives except the deque's steal end and the
+// honey counter Winnie raids. The hive thread constructs the hive and allocates its bees and
+// deque itself, so with pinning all of it is first touched on its own node.
+class ColonyHive {
+    friend class Colony;
 
-    template<typename RNG>
-    int Next(RNG &engine) {
-        return distribution_(engine);
+    class Colony *colony_;
+    int index_;
+    TimeDistribution bee_hunting_time_;
+    TimeDistribution bee_release_time_;
+    std::uint32_t release_ticks_ = 0;
+
+    std::vector<ColonyBee> own_bees_;
+    std::unique_ptr<WorkStealingDeque<ColonyBee *>> bees_currently_in_hive_;
+    alignas(kCacheLineSize) std::atomic<int> honey_count_ = 0;
+    // When honey last reached Winnie's threshold; 0 once Winnie has acted on it.
+    std::atomic<std::int64_t> honey_ready_at_ns_ = 0;
+    TimerWheel hunting_;
+    int cpu_;  // -1 when not pinned
+    int node_ = 0;
+    // Other hives, those on our node first, so steals rarely move bees across nodes.
+    std::vector<ColonyHive *> steal_order_;
+
+    // Written by this hive's thread only; read after it is joined.
+    HiveStats stats_;
+    std::int64_t steals_ = 0;
+    std::int64_t cross_node_returns_ = 0;
+    std::vector<ColonyBee *> release_bees_;
+    RngBatch hunt_draws_;
+
+    int Size() const {
+        return bees_currently_in_hive_->SizeApprox();
     }
-};
 
-using BeeHuntSettings = RNGSettings<800, 1200>;
-using BeeReleaseSettings = RNGSettings<50, 100>;
+    void Record(HiveEventType type, int bee) {
+        Record(type, bee, Size());
+    }
 
-using namespace std::literals;  // NOLINT
+    void Record(HiveEventType type, int bee, int hive_size) {
+        if (event_stream.Enabled()) {
+            event_stream.Record(type, bee, honey_count_, hive_size);
+        }
+    }
 
-struct Bee {
-    std::mutex bee_mutex_;
-    bool at_home_ = true;
-    std::chrono::milliseconds time_to_hunt_;
-    std::condition_variable condition_;
-    struct Hive *owner_;
-    std::thread this_thread_;
-    int id_;
+    void Setup(std::latch &ready);
+    ColonyBee *TakeBee();
+    void ReleaseBatch(int max_bees, std::uint64_t now);
+    void ReturnOne(ColonyBee &bee);
+    void Run(std::latch &ready);
 
-    bool stop_signal_ = false;
+public:
+    ColonyHive(Colony *colony, int index, const HiveTimes &times, int cpu)
+            : colony_(colony), index_(index), bee_hunting_time_(times.hunt_), bee_release_time_(times.release_),
+              cpu_(cpu) {}
+};
 
-    Bee(Hive *owner, int id)
-            : owner_(owner), id_(id) {}
+// Hive and Winnie sharded across `num_hives` threads. Each bee starts in hive id % num_hives
+// and returns to whichever hive released it; a hive with no spare bee steals one from its
+// neighbours, so idle bees drift to the hives that have time to release them.
+class Colony {
+    friend class ColonyHive;
 
-    Bee(Bee &&other)
-            : at_home_(other.at_home_), time_to_hunt_(other.time_to_hunt_), owner_(other.owner_),
-              this_thread_(std::move(other.this_thread_)), id_(other.id_) {}
+    // One wheel tick is one millisecond since epoch_.
+    const std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+    const CpuTopology topology_ = CpuTopology::Detect();
+    std::vector<std::unique_ptr<ColonyHive>> hives_;  // each built by its own thread in Start
+    std::vector<std::thread> hive_threads_;
+    HiveTimes times_;
+    int num_bees_;
+    int release_batch_;
+    bool pin_;
+    std::atomic<bool> stop_signal_ = false;
 
-    void Start() {
-        this_thread_ = std::thread([this]() { Run(); });
+    // Bumped whenever a hive's honey reaches the attack threshold; Winnie waits on it.
+    std::atomic<std::uint32_t> honey_epoch_ = 0;
+    std::thread winnie_thread_;
+    std::uint32_t winnie_scans_ = 0;
+    HiveStats winnie_stats_;
+
+    std::uint64_t Now() const {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - epoch_).count());
     }
 
-    void Hunt(std::chrono::milliseconds time) {
-        {
-            std::unique_lock<std::mutex> lock{bee_mutex_};
-            at_home_ = false;
-            time_to_hunt_ = time;
-        }
-        condition_.notify_one();
+    int CpuOf(int hive) const {
+        return pin_ ? topology_.CpuFor(hive) : -1;
     }
 
-    void End() {
-        stop_signal_ = true;
-        condition_.notify_all();
+    // The node hive `hive` is placed on; 0 for all of them without pinning.
+    int NodeOf(int hive) const {
+        return pin_ ? topology_.NodeOf(topology_.CpuFor(hive)) : 0;
     }
 
-    void Finish() {
-        if (this_thread_.joinable()) {
-            this_thread_.join();
+    // Pins the thread, then builds and runs hive `index` on it.
+    void RunHive(int index, std::latch &built, std::latch &ready) {
+        int cpu = CpuOf(index);
+        if (cpu >= 0) {
+            PinThisThread(std::span<const int>{&cpu, 1});
         }
+        hives_[index] = std::make_unique<ColonyHive>(this, index, times_, cpu);
+        built.arrive_and_wait();
+        hives_[index]->Run(ready);
     }
 
-    void Run();
-};
+    void WinnieRun() {
+        while (!stop_signal_) {
+            std::uint32_t seen = honey_epoch_.load();
+            // Start the scan at a random hive so no hive is always raided first.
+            std::size_t first = PhiloxEngine{rng_seed, RngStream::kWinnie, 0, winnie_scans_++}() % hives_.size();
+            ColonyHive *target = nullptr;
+            for (std::size_t i = 0; i < hives_.size() && target == nullptr; ++i) {
+                ColonyHive *hive = hives_[(first + i) % hives_.size()].get();
+                if (hive->honey_count_ >= Winnie::kAttackHoneyThreshold) {
+                    target = hive;
+                }
+            }
+            if (target == nullptr) {
+                honey_epoch_.wait(seen);
+                continue;
+            }
 
-struct Hive {
-    BeeHuntSettings bee_hunting_time_;
-    BeeReleaseSettings bee_release_time_;
-    static constexpr int kMaxHoneyCount = 30;
+            if (std::int64_t ready_at = target->honey_ready_at_ns_.exchange(0); ready_at != 0) {
+                latency_stats.Record(LatencyMetric::kReturnToWinnie, LatencyNowNs() - ready_at);
+            }
+            ++winnie_stats_.attacks_;
+            metrics_registry.Add(CounterMetric::kAttacks);
+            TraceScope attack{TraceSpanType::kAttack, target->index_, kTraceWinnieTrack};
+            SYNC_LOG(kInfo, "Winnie is trying to attack hive ", target->index_, ". Hive bee count is: ", target->Size(), "\n");
+            target->Record(HiveEventType::kAttackAttempt, HiveEvent::kNoBee);
+            bool attacked = target->Size() < Hive::kMinDefenders;
+            attack.End(attacked);
+            if (attacked) {
+                ++winnie_stats_.successful_attacks_;
+                metrics_registry.Add(CounterMetric::kSuccessfulAttacks);
+                target->honey_count_ = 0;
+                target->Record(HiveEventType::kAttackSuccess, HiveEvent::kNoBee);
+                SYNC_LOG(kInfo, "Winnie succesfully attacked hive ", target->index_, " and ate all honey\n");
+                continue;
+            }
+            ++winnie_stats_.cures_;
+            metrics_registry.Add(CounterMetric::kCures);
+            SYNC_LOG(kInfo, "Winnie is curing himself :(\n");
+            target->Record(HiveEventType::kCure, HiveEvent::kNoBee);
+            TraceScope cure{TraceSpanType::kCure, target->index_, kTraceWinnieTrack};
+            std::this_thread::sleep_for(std::chrono::milliseconds{Winnie::kCureTime});
+            SYNC_LOG(kInfo, "Winnie is healthy now\n");
+        }
+        SYNC_LOG(kInfo, "Shutting down Winnie the pooh\n");
+    }
 
-    std::vector<Bee> all_bees_;
-    std::mutex queue_mutex_;
-    std::queue<Bee *> bees_currently_in_hive_;
-    std::condition_variable bee_count_condition_;
-    std::condition_variable honey_count_condition_;
-    std::atomic<int> honey_count_ = 0;
-    std::mt19937 rng_;
-    std::mutex hive_mutex_;
-    std::thread this_thread_;
+public:
+    // With `pin`, hive i runs on CpuTopology::CpuFor(i), spreading hives over the NUMA nodes.
+    Colony(int num_bees, int num_hives, int release_batch = 1, bool pin = false, const HiveTimes &times = {})
+            : hives_(std::max(1, num_hives)), times_(times), num_bees_(num_bees), release_batch_(release_batch),
+              pin_(pin) {}
 
-    bool stop_signal_ = false;
+    ~Colony() {
+        End();
+    }
 
-    Hive(int num_bees) {
-        all_bees_.reserve(num_bees);
-        for (int i = 0; i < num_bees; ++i) {
-            auto &bee = all_bees_.emplace_back(this, i);
-            bees_currently_in_hive_.push(std::addressof(bee));
+    // Returns once every hive has been built and has allocated its bees.
+    void Start() {
+        if (pin_) {
+            SYNC_LOG(kInfo, "Pinning ", hives_.size(), " hives over ", topology_.Nodes(), " NUMA nodes\n");
         }
+        std::latch built{static_cast<std::ptrdiff_t>(hives_.size())};
+        std::latch ready{static_cast<std::ptrdiff_t>(hives_.size())};
+        for (int i = 0; i < static_cast<int>(hives_.size()); ++i) {
+            hive_threads_.emplace_back([this, i, &built, &ready]() { RunHive(i, built, ready); });
+        }
+        ready.wait();
+        winnie_thread_ = std::thread([this]() { WinnieRun(); });
     }
 
-    ~Hive() {
-        for (auto &bee: all_bees_) {
-            bee.Finish();
+    void End() {
+        if (!winnie_thread_.joinable()) {
+            return;
         }
-        if (this_thread_.joinable()) {
-            this_thread_.join();
+        SYNC_LOG(kInfo, "Shutting down the application\n");
+        if (event_stream.Enabled()) {
+            event_stream.Record(HiveEventType::kShutdown, HiveEvent::kNoBee, 0, 0);
         }
+        stop_signal_ = true;
+        ++honey_epoch_;
+        honey_epoch_.notify_all();
+        for (auto &thread: hive_threads_) {
+            thread.join();
+        }
+        winnie_thread_.join();
+
+        HiveStats total = Stats();
+        std::int64_t steals = 0, cross_node_returns = 0;
+        for (auto &hive: hives_) {
+            steals += hive->steals_;
+            cross_node_returns += hive->cross_node_returns_;
+        }
+        SYNC_LOG(kInfo, "Hives: ", hives_.size(), ", releases: ", total.releases_, ", returns: ", total.returns_,
+                 ", steals: ", steals, "\n");
+        SYNC_LOG(kInfo, "Cross-node returns: ", cross_node_returns, " of ", total.returns_, " over ",
+                 topology_.Nodes(), " NUMA nodes\n");
+        SYNC_LOG(kInfo, "Attacks: ", total.attacks_, " (", total.successful_attacks_, " successful), cures: ",
+                 total.cures_, "\n");
+        latency_stats.Report();
+        sync_logger.Flush();
     }
 
-    void Start() {
-        for (auto &b: all_bees_) {
-            b.Start();
+    // Lock-free: deque sizes and honey counters are atomics.
+    HiveGauges Gauges() const {
+        HiveGauges gauges;
+        for (auto &hive: hives_) {
+            gauges.bees_in_hive_ += hive->Size();
+            gauges.honey_ += hive->honey_count_.load();
         }
-        this_thread_ = std::thread([this]() { Run(); });
+        gauges.bees_hunting_ = num_bees_ - gauges.bees_in_hive_;
+        return gauges;
     }
 
-    int Size() {
-        // We need this mutex only here because push and pop are guarded by hive_mutex_
-        std::unique_lock<std::mutex> lock{queue_mutex_};
-        return bees_currently_in_hive_.size();
+    // Valid after End.
+    HiveStats Stats() const {
+        HiveStats total = winnie_stats_;
+        for (auto &hive: hives_) {
+            total.releases_ += hive->stats_.releases_;
+            total.returns_ += hive->stats_.returns_;
+        }
+        return total;
     }
+};
 
-    void ReleaseOne() {
-        Bee *next = [this]() {
-            std::unique_lock<std::mutex> lock{hive_mutex_};
-            Bee *next = bees_currently_in_hive_.front();
-            bees_currently_in_hive_.pop();
-            return next;
-        }();
+// Runs on the hive thread, once every hive is built and before any hive starts releasing.
+void ColonyHive::Setup(std::latch &ready) {
+    node_ = cpu_ >= 0 ? colony_->topology_.NodeOf(cpu_) : colony_->topology_.CurrentNode();
+    int num_bees = colony_->num_bees_;
+    int num_hives = static_cast<int>(colony_->hives_.size());
+    for (bool same_node: {true, false}) {
+        for (int i = 1; i < num_hives; ++i) {
+            int other = (index_ + i) % num_hives;
+            if ((colony_->NodeOf(other) == colony_->NodeOf(index_)) == same_node) {
+                steal_order_.push_back(colony_->hives_[other].get());
+            }
+        }
+    }
+    // Every deque can hold the whole colony: stealing may gather all bees in one hive.
+    bees_currently_in_hive_ = std::make_unique<WorkStealingDeque<ColonyBee *>>(num_bees);
+    own_bees_.reserve(num_bees / num_hives + 1);
+    for (int id = index_; id < num_bees; id += num_hives) {
+        own_bees_.emplace_back(id, node_);
+    }
+    for (auto &bee: own_bees_) {
+        bees_currently_in_hive_->PushBottom(&bee);
+    }
+    ready.count_down();
+}
 
-        int release_ms = bee_hunting_time_.Next(rng_);
-        sync_log("Bee ", next->id_, " is going for a hunt for ", release_ms, "ms. Current bee count: ", Size(), "\n");
-        next->Hunt(std::chrono::milliseconds{release_ms});
+// A bee of our own if we can spare one, otherwise one our neighbours can spare.
+ColonyBee *ColonyHive::TakeBee() {
+    ColonyBee *bee;
+    if (Size() > 1 && bees_currently_in_hive_->PopBottom(bee)) {
+        return bee;
+    }
+    for (ColonyHive *victim: steal_order_) {
+        if (victim->Size() > 1 && victim->bees_currently_in_hive_->Steal(bee)) {
+            ++steals_;
+            return bee;
+        }
     }
+    return nullptr;
+}
 
-    void ReturnOne(Bee *bee) {
-        {
-            std::unique_lock<std::mutex> lock{hive_mutex_};
-            bees_currently_in_hive_.push(bee);
-            if (honey_count_ < kMaxHoneyCount) {
-                ++honey_count_;
-            }
-            sync_log("Bee ", bee->id_, " returned from a hunt. Current honey: ", honey_count_, "\n");
+void ColonyHive::ReleaseBatch(int max_bees, std::uint64_t now) {
+    release_bees_.clear();
+    hunt_draws_.Clear();
+    for (ColonyBee *bee; static_cast<int>(release_bees_.size()) < max_bees && (bee = TakeBee()) != nullptr;) {
+        release_bees_.push_back(bee);
+        hunt_draws_.Add(bee->id_, bee->trips_++);
+    }
+    bee_hunting_time_.FillAt(RngStream::kBeeHunt, hunt_draws_);
+    int at_home = Size();
+    for (std::size_t i = 0; i < release_bees_.size(); ++i) {
+        ColonyBee *next = release_bees_[i];
+        int release_ms = hunt_draws_.values_[i];
+        int bee_count = at_home + static_cast<int>(release_bees_.size() - 1 - i);
+        ++stats_.releases_;
+        metrics_registry.Add(CounterMetric::kReleases);
+        SYNC_LOG(kDebug, "Hive ", index_, ": bee ", next->id_, " is going for a hunt for ", release_ms, "ms. Current bee count: ", bee_count, "\n");
+        Record(HiveEventType::kBeeReleased, next->id_, bee_count);
+        next->expiry_ = now + static_cast<std::uint64_t>(release_ms);
+        next->released_at_ns_ = trace_recorder.Enabled() ? LatencyNowNs() : 0;
+        hunting_.Insert(*next);
+    }
+}
+
+void ColonyHive::ReturnOne(ColonyBee &bee) {
+    if (bee.released_at_ns_ != 0 && trace_recorder.Enabled()) {
+        trace_recorder.Record(TraceSpanType::kHunt, index_, kTraceFirstBeeTrack + bee.id_, bee.released_at_ns_,
+                              LatencyNowNs(), bee.id_);
+    }
+    bees_currently_in_hive_->PushBottom(&bee);
+    ++stats_.returns_;
+    metrics_registry.Add(CounterMetric::kReturns);
+    if (bee.home_node_ != node_) {
+        ++cross_node_returns_;
+    }
+    int honey = honey_count_.load();
+    while (honey < Hive::kMaxHoneyCount) {
+        if (honey + 1 == Winnie::kAttackHoneyThreshold) {
+            // Stamped before the add publishes the crossing, so Winnie never sees the honey first.
+            honey_ready_at_ns_.store(LatencyNowNs());
+        }
+        if (honey_count_.compare_exchange_weak(honey, honey + 1)) {
+            break;
         }
-        bee_count_condition_.notify_one();
-        honey_count_condition_.notify_one();
     }
+    SYNC_LOG(kDebug, "Hive ", index_, ": bee ", bee.id_, " returned from a hunt. Current honey: ", honey_count_, "\n");
+    Record(HiveEventType::kBeeReturned, bee.id_);
+    if (honey + 1 == Winnie::kAttackHoneyThreshold) {
+        ++colony_->honey_epoch_;
+        colony_->honey_epoch_.notify_one();
+    }
+}
 
-    bool TryAttack() {
-        if (Size() < 3) {
-            honey_count_ = 0;
-            return true;
-        } else {
+void ColonyHive::Run(std::latch &ready) {
+    Setup(ready);
+    hunting_.Advance(colony_->Now(), [](TimerNode &) {});
+    std::uint64_t next_release = hunting_.Current();
+    while (!colony_->stop_signal_) {
+        std::uint64_t now = colony_->Now();
+        if (cpu_ < 0) {
+            node_ = colony_->topology_.CurrentNode();
+        }
+        hunting_.Advance(now, [this](TimerNode &node) { ReturnOne(static_cast<ColonyBee &>(node)); });
+        if (now >= next_release) {
+            TraceScope tick{TraceSpanType::kReleaseTick, index_, kTraceHiveTrack};
+            ReleaseBatch(colony_->release_batch_, now);
+            tick.End(static_cast<std::int32_t>(release_bees_.size()));
+            next_release = now + static_cast<std::uint64_t>(bee_release_time_.At(RngStream::kHiveRelease, index_, release_ticks_++));
+        }
+        std::uint64_t wake = next_release;
+        if (!hunting_.Empty()) {
+            wake = std::min(wake, now + hunting_.TicksUntilNext());
+        }
+        std::this_thread::sleep_until(colony_->epoch_ + std::chrono::milliseconds{wake});
+    }
+    SYNC_LOG(kInfo, "Shutting down hive ", index_, "\n");
+}
+
+// The hive queue as it was before BoundedQueue: push/pop under hive_mutex_, Size() under queue_mutex_.
+template<typename T>
+class LockedQueue {
+    HotMutex hive_mutex_{"LockedQueue::hive_mutex_"};
+    HotMutex queue_mutex_{"LockedQueue::queue_mutex_"};
+    std::queue<T> queue_;
+
+public:
+    explicit LockedQueue(std::size_t) {}
+
+    bool TryPush(const T &value) {
+        auto lock = LockHot(hive_mutex_);
+        auto size_lock = LockHot(queue_mutex_);
+        queue_.push(value);
+        return true;
+    }
+
+    bool TryPop(T &value) {
+        auto lock = LockHot(hive_mutex_);
+        auto size_lock = LockHot(queue_mutex_);
+        if (queue_.empty()) {
             return false;
         }
+        value = queue_.front();
+        queue_.pop();
+        return true;
     }
 
-    void Run() {
-        while (!stop_signal_) {
-            std::unique_lock<std::mutex> lock{hive_mutex_};
-            if (Size() <= 1) {
-                bee_count_condition_.wait(lock, [this]() { return Size() > 1 || stop_signal_; });
-            }
+    std::size_t SizeApprox() {
+        auto lock = LockHot(queue_mutex_);
+        return queue_.size();
+    }
+};
 
-            if (stop_signal_) {
-                sync_log("Shutting down hive\n");
-                return;
+// Release/return cycles against a hive queue holding `num_bees` bees: every thread pops a bee
+// and pushes it back, checking the size every few operations like Hive::Run and Winnie do.
+template<template<typename> class Queue>
+double MeasureHiveQueue(int num_bees, int num_threads, std::chrono::milliseconds duration) {
+    std::vector<int> bees(num_bees);
+    Queue<int *> queue(bees.size());
+    for (auto &bee: bees) {
+        queue.TryPush(&bee);
+    }
+
+    std::atomic<bool> stop = false;
+    std::atomic<std::uint64_t> total_ops = 0;
+    // Keeps the size reads from being optimized away.
+    std::atomic<std::size_t> size_sink = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&]() {
+            std::uint64_t ops = 0;
+            std::size_t sizes = 0;
+            int *bee;
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (queue.TryPop(bee)) {
+                    queue.TryPush(bee);
+                    ops += 2;
+                }
+                if (ops % 16 == 0) {
+                    sizes += queue.SizeApprox();
+                }
             }
+            total_ops += ops;
+            size_sink += sizes;
+        });
+    }
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    return static_cast<double>(total_ops) / std::chrono::duration<double>(duration).count();
+}
 
-            lock.unlock();
-            ReleaseOne();
+// How bees were parked before ParkingSlot: a flag under a mutex plus a condition variable.
+class CondVarParking {
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool notified_ = false;
 
-            std::this_thread::sleep_for(std::chrono::milliseconds{bee_release_time_.Next(rng_)});
-        }
-        sync_log("Shutting down hive\n");
+public:
+    void Park() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        condition_.wait(lock, [this]() { return notified_; });
+        notified_ = false;
     }
 
-    void End() {
-        stop_signal_ = true;
-        for (auto &bee: all_bees_) {
-            bee.End();
+    void Unpark() {
+        {
+            std::unique_lock<std::mutex> lock{mutex_};
+            notified_ = true;
         }
-        bee_count_condition_.notify_all();
-        honey_count_condition_.notify_all();
+        condition_.notify_one();
     }
 };
 
-void Bee::Run() {
-    while (!stop_signal_) {
-        std::unique_lock<std::mutex> lock{bee_mutex_};
-        condition_.wait(lock, [this] { return !at_home_ || stop_signal_; });
+// Release-to-wake latency in ns: one thread unparks a sleeping bee thread and the bee records
+// how long it took to run again. Each round waits until the bee is back asleep.
+template<typename Parking>
+std::vector<std::int64_t> MeasureWakeLatency(int rounds) {
+    Parking parking;
+    std::atomic<std::int64_t> unparked_at = 0;
+    std::atomic<std::uint32_t> rounds_done = 0;
+    std::vector<std::int64_t> latencies;
+    latencies.reserve(rounds);
+    auto now_ns = []() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
 
-        if (stop_signal_) {
-            sync_log("Shutting down bee #", id_, "\n");
-            return;
+    std::thread bee([&]() {
+        for (int round = 0; round < rounds; ++round) {
+            parking.Park();
+            latencies.push_back(now_ns() - unparked_at.load());
+            ++rounds_done;
+            rounds_done.notify_one();
         }
+    });
+    for (std::uint32_t round = 0; round < static_cast<std::uint32_t>(rounds); ++round) {
+        // Give the bee time to get from its last round into Park and fall asleep.
+        std::this_thread::sleep_for(50us);
+        unparked_at = now_ns();
+        parking.Unpark();
+        rounds_done.wait(round);
+    }
+    bee.join();
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
 
-        std::this_thread::sleep_for(time_to_hunt_);
-        at_home_ = true;
-        owner_->ReturnOne(this);
+void RunWakeBenchmark() {
+    constexpr int kRounds = 20000;
+    auto percentile = [](const std::vector<std::int64_t> &sorted, double p) {
+        return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(p * sorted.size()))];
+    };
+    auto report = [&](const char *name, std::size_t bytes, const std::vector<std::int64_t> &sorted) {
+        std::cout << name << "," << bytes << "," << percentile(sorted, 0.5) << "," << percentile(sorted, 0.99) << ","
+                  << percentile(sorted, 0.999) << "," << sorted.back() << "\n";
+    };
+    std::cout << "parking,bytes_per_bee,p50_ns,p99_ns,p999_ns,max_ns\n";
+    report("condition_variable", sizeof(CondVarParking), MeasureWakeLatency<CondVarParking>(kRounds));
+    report("atomic_wait", sizeof(ParkingSlot), MeasureWakeLatency<ParkingSlot>(kRounds));
+}
+
+void RunQueueBenchmark() {
+    int num_threads = static_cast<int>(std::clamp(std::thread::hardware_concurrency(), 2u, 8u));
+    std::cout << "bees,threads,locked_ops_per_sec,lock_free_ops_per_sec,speedup\n";
+    for (int num_bees: {10, 1000, 100000}) {
+        double locked = MeasureHiveQueue<LockedQueue>(num_bees, num_threads, 500ms);
+        double lock_free = MeasureHiveQueue<BoundedQueue>(num_bees, num_threads, 500ms);
+        std::cout << num_bees << "," << num_threads << "," << static_cast<std::uint64_t>(locked) << ","
+                  << static_cast<std::uint64_t>(lock_free) << "," << lock_free / locked << "\n";
     }
-    sync_log("Shutting down bee #", id_, "\n");
 }
 
-struct Winnie {
-    Hive *hive_;
-    std::thread this_thread_;
+// Sweeps a colony of `num_bees` bees with random due times once per millisecond tick.
+void RunSweepBenchmark(int num_bees, int num_ticks) {
+    BeeColony colony{num_bees};
+    BeeHuntSettings hunt_time;
+    for (int i = 0; i < num_bees; ++i) {
+        colony.Release(i, hunt_time.At(RngStream::kBeeHunt, i, 0));
+    }
 
-    bool stop_signal_ = false;
+    std::vector<int> returned;
+    returned.reserve(num_bees);
+    std::uint64_t total_returned = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < num_ticks; ++tick) {
+        returned.clear();
+        colony.SweepReturns(800 + tick, returned);
+        total_returned += returned.size();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
 
-    static constexpr int kCureTime = 2000;
+    double per_tick = elapsed.count() / num_ticks;
+    std::cout << "kernel,bees,ticks,returned,ms_per_tick,ns_per_bee,bees_per_sec\n"
+              << SelectedSweepKernel().name_ << "," << num_bees << "," << num_ticks << "," << total_returned << ","
+              << per_tick * 1e3 << "," << per_tick * 1e9 / num_bees << "," << num_bees / per_tick << "\n";
+}
 
-    Winnie(Hive *hive)
-            : hive_(hive) {}
+// Draws hunt times for `num_draws` bees per batch through the selected kernel and one at a time.
+void RunRngBenchmark(int num_draws, int num_batches) {
+    BeeHuntSettings hunt_time;
+    RngBatch batch;
+    for (int i = 0; i < num_draws; ++i) {
+        batch.Add(i, 0);
+    }
 
-    ~Winnie() {
-        if (this_thread_.joinable()) {
-            this_thread_.join();
-        }
+    std::int64_t checksum = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (int round = 0; round < num_batches; ++round) {
+        std::fill(batch.events_.begin(), batch.events_.end(), static_cast<std::uint32_t>(round));
+        hunt_time.FillAt(RngStream::kBeeHunt, batch);
+        checksum += batch.values_[round % num_draws];
     }
+    std::chrono::duration<double> batched = std::chrono::steady_clock::now() - started;
 
-    void Start() {
-        this_thread_ = std::thread([this]() { Run(); });
+    started = std::chrono::steady_clock::now();
+    for (int round = 0; round < num_batches; ++round) {
+        for (int i = 0; i < num_draws; ++i) {
+            batch.values_[i] = hunt_time.At(RngStream::kBeeHunt, i, round);
+        }
+        checksum -= batch.values_[round % num_draws];
     }
+    std::chrono::duration<double> single = std::chrono::steady_clock::now() - started;
 
-    bool Attack() {
-        sync_log("Winnie is trying to attack the hive. Hive bee count is: ", hive_->Size(), "\n");
-        return hive_->TryAttack();
+    double draws = static_cast<double>(num_draws) * num_batches;
+    std::cout << "kernel,draws,batched_draws_per_sec,single_draws_per_sec,speedup,checksum\n"
+              << SelectedPhiloxKernel().name_ << "," << draws << "," << draws / batched.count() << ","
+              << draws / single.count() << "," << single.count() / batched.count() << "," << checksum << "\n";
+}
+
+// The --bench=hive matrix: every engine x bee count x distribution, each run headless.
+struct HiveBenchConfig {
+    std::vector<std::string_view> engines_{"threads", "coro", "colony", "sim"};
+    std::vector<int> bees_{10, 1000, 10000};
+    std::vector<std::pair<std::string, HiveTimes>> distributions_;  // label, times
+    // One thread per bee gets impractical beyond this unless asked for explicitly.
+    int max_threaded_bees_ = 1000;
+    std::chrono::milliseconds duration_{2000};
+    int workers_ = 1;
+    int hives_ = 1;
+    std::string baseline_;
+    double regression_pct_ = 10;
+};
+
+struct HiveBenchResult {
+    std::string key_;  // engine,bees,distribution
+    double seconds_ = 0;
+    double cpu_seconds_ = 0;
+    HiveStats stats_;
+    LatencySummary mutex_wait_;
+
+    std::uint64_t Events() const {
+        return stats_.releases_ + stats_.returns_ + stats_.attacks_ + stats_.successful_attacks_ + stats_.cures_;
     }
 
-    void Cure() {
-        sync_log("Winnie is curing himself :(\n");
-        std::this_thread::sleep_for(std::chrono::milliseconds{kCureTime});
-        sync_log("Winnie is healthy now\n");
+    double CpuNsPerEvent() const {
+        return Events() == 0 ? 0 : cpu_seconds_ * 1e9 / Events();
     }
+};
 
-    void Run() {
-        while (!stop_signal_) {
-            std::unique_lock<std::mutex> lock{hive_->hive_mutex_};
-            hive_->honey_count_condition_.wait(lock, [this]() { return hive_->honey_count_ >= 15 || stop_signal_; });
+// The simulation runs this many times the configured duration of hive time, so it takes long
+// enough to time.
+constexpr int kSimBenchTimeScale = 60;
 
-            if (stop_signal_) {
-                sync_log("Shutting down Winnie the pooh\n");
-                return;
+// Rates of the real-time engines are per second of hive time; the simulation's are per second of
+// wall time spent simulating.
+HiveBenchResult RunHiveBenchCell(const HiveBenchConfig &config, std::string_view engine, int num_bees,
+                                 const std::string &label, const HiveTimes &times) {
+    HiveBenchResult result;
+    result.key_ = std::string{engine} + "," + std::to_string(num_bees) + "," + label;
+    int batch_bees = engine == "colony" ? num_bees / std::max(1, config.hives_) : num_bees;
+    int release_batch = Hive::AutoReleaseBatch(batch_bees, times);
+
+    latency_stats.Reset();
+    std::clock_t cpu_started = std::clock();
+    auto started = std::chrono::steady_clock::now();
+    if (engine == "threads") {
+        App app{num_bees, release_batch, times};
+        app.Start();
+        std::this_thread::sleep_for(config.duration_);
+        app.End();
+        result.stats_ = app.Stats();
+    } else if (engine == "coro") {
+        CoroScheduler scheduler{config.workers_};
+        CoroHive hive{&scheduler, num_bees, release_batch, times};
+        hive.Start();
+        std::this_thread::sleep_for(config.duration_);
+        hive.End();
+        result.stats_ = hive.Stats();
+    } else if (engine == "colony") {
+        Colony colony{num_bees, config.hives_, release_batch, false, times};
+        colony.Start();
+        std::this_thread::sleep_for(config.duration_);
+        colony.End();
+        result.stats_ = colony.Stats();
+    } else {
+        result.stats_ = Simulation{num_bees, Simulation::ReturnScan::kSweep, release_batch, times}.Run(
+                config.duration_ * kSimBenchTimeScale);
+    }
+    result.cpu_seconds_ = static_cast<double>(std::clock() - cpu_started) / CLOCKS_PER_SEC;
+    result.seconds_ = engine == "sim" ? std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count()
+                                      : std::chrono::duration<double>(config.duration_).count();
+    result.mutex_wait_ = latency_stats.Merge(LatencyMetric::kHiveMutexWait);
+    return result;
+}
+
+// events_per_sec and cpu_ns_per_event from an earlier --bench=hive CSV, by engine,bees,distribution.
+// Nothing, after printing why to stderr, if the file cannot be read, lacks one of those columns or
+// has a malformed row.
+std::optional<std::unordered_map<std::string, std::pair<double, double>>> LoadHiveBenchBaseline(
+        const std::string &path) {
+    std::ifstream in{path};
+    std::string line;
+    if (!in) {
+        std::cerr << "Cannot open baseline " << path << "\n";
+        return std::nullopt;
+    }
+    if (!std::getline(in, line)) {
+        std::cerr << "Baseline " << path << " is empty\n";
+        return std::nullopt;
+    }
+    auto split = [](const std::string &text) {
+        std::vector<std::string> fields;
+        std::istringstream stream{text};
+        for (std::string field; std::getline(stream, field, ',');) {
+            fields.push_back(field);
+        }
+        return fields;
+    };
+    std::vector<std::string> header = split(line);
+    std::array<std::size_t, 5> columns{};
+    constexpr std::array<std::string_view, 5> kNames{"engine", "bees", "distribution", "events_per_sec",
+                                                     "cpu_ns_per_event"};
+    for (std::size_t i = 0; i < kNames.size(); ++i) {
+        columns[i] = static_cast<std::size_t>(std::find(header.begin(), header.end(), kNames[i]) - header.begin());
+        if (columns[i] == header.size()) {
+            std::cerr << "Baseline " << path << " has no " << kNames[i] << " column\n";
+            return std::nullopt;
+        }
+    }
+    auto [engine, bees, distribution, events, cpu] = columns;
+    std::unordered_map<std::string, std::pair<double, double>> baseline;
+    for (int line_number = 2; std::getline(in, line); ++line_number) {
+        if (line.empty()) {
+            continue;
+        }
+        std::vector<std::string> fields = split(line);
+        std::pair<double, double> rates;
+        auto parse = [&](std::size_t column, double &out) {
+            if (column >= fields.size()) {
+                return false;
             }
+            const std::string &field = fields[column];
+            auto [end, ec] = std::from_chars(field.data(), field.data() + field.size(), out);
+            return !field.empty() && ec == std::errc{} && end == field.data() + field.size();
+        };
+        if (fields.size() < header.size() || !parse(events, rates.first) || !parse(cpu, rates.second)) {
+            std::cerr << "Malformed baseline row at " << path << ":" << line_number << "\n";
+            return std::nullopt;
+        }
+        baseline[fields[engine] + "," + fields[bees] + "," + fields[distribution]] = rates;
+    }
+    if (baseline.empty()) {
+        std::cerr << "Baseline " << path << " has no rows\n";
+        return std::nullopt;
+    }
+    return baseline;
+}
+
+// Prints one CSV row per cell; returns nonzero if the baseline cannot be loaded, lacks a cell, or
+// any cell regressed against it by more than regression_pct_ in events/sec or CPU per event.
+int RunHiveBenchmark(const HiveBenchConfig &config) {
+    std::unordered_map<std::string, std::pair<double, double>> baseline;
+    if (!config.baseline_.empty()) {
+        auto loaded = LoadHiveBenchBaseline(config.baseline_);
+        if (!loaded) {
+            return 1;
+        }
+        baseline = std::move(*loaded);
+    }
+    std::cout << "engine,bees,distribution,seconds,events,events_per_sec,releases_per_sec,returns_per_sec,"
+                 "cpu_seconds,cpu_ns_per_event,mutex_acquisitions,mutex_wait_p99_ns,mutex_wait_max_ns";
+    if (!config.baseline_.empty()) {
+        std::cout << ",baseline_events_per_sec,events_per_sec_change_pct,baseline_cpu_ns_per_event,"
+                     "cpu_ns_per_event_change_pct";
+    }
+    std::cout << "\n";
 
-            if (Attack()) {
-                sync_log("Winnie succesfully attacked the hive and ate all honey\n");
+    sync_logger.Mute(true);
+    int failures = 0;
+    for (std::string_view engine: config.engines_) {
+        for (int num_bees: config.bees_) {
+            if (engine == "threads" && num_bees > config.max_threaded_bees_) {
                 continue;
-            } else {
-                lock.unlock();
-                Cure();
+            }
+            for (const auto &[label, times]: config.distributions_) {
+                HiveBenchResult result = RunHiveBenchCell(config, engine, num_bees, label, times);
+                double events_per_sec = result.Events() / result.seconds_;
+                std::cout << result.key_ << "," << result.seconds_ << "," << result.Events() << "," << events_per_sec
+                          << "," << result.stats_.releases_ / result.seconds_ << ","
+                          << result.stats_.returns_ / result.seconds_ << "," << result.cpu_seconds_ << ","
+                          << result.CpuNsPerEvent() << "," << result.mutex_wait_.Count() << ","
+                          << result.mutex_wait_.Percentile(0.99) << "," << result.mutex_wait_.Max();
+                if (!config.baseline_.empty()) {
+                    auto found = baseline.find(result.key_);
+                    if (found == baseline.end()) {
+                        std::cout << ",,,,";
+                        std::cerr << "No baseline row for " << result.key_ << "\n";
+                        ++failures;
+                    } else {
+                        auto [base_events, base_cpu] = found->second;
+                        double events_change = base_events == 0 ? 0 : (events_per_sec / base_events - 1) * 100;
+                        double cpu_change = base_cpu == 0 ? 0 : (result.CpuNsPerEvent() / base_cpu - 1) * 100;
+                        std::cout << "," << base_events << "," << events_change << "," << base_cpu << "," << cpu_change;
+                        if (events_change < -config.regression_pct_ || cpu_change > config.regression_pct_) {
+                            std::cerr << "Regression in " << result.key_ << ": events/sec " << events_change
+                                      << "%, CPU per event " << cpu_change << "%\n";
+                            ++failures;
+                        }
+                    }
+                }
+                std::cout << "\n" << std::flush;
             }
         }
-        sync_log("Shutting down Winnie the pooh\n");
     }
+    sync_logger.Mute(false);
+    return failures == 0 ? 0 : 1;
+}
 
-    void End() {
-        stop_signal_ = true;
+// Parses the value of a `--name=VALUE` option into `out`. False, after printing a usage error,
+// unless all of VALUE is a number in [min, max].
+template<typename T>
+bool ParseNumberOption(std::string_view arg, T &out, std::type_identity_t<T> min = std::numeric_limits<T>::lowest(),
+                       std::type_identity_t<T> max = std::numeric_limits<T>::max()) {
+    std::string_view text = arg.substr(arg.find('=') + 1);
+    T value{};
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (text.empty() || ec != std::errc{} || end != text.data() + text.size() || !(value >= min && value <= max)) {
+        std::cerr << "Invalid value for " << arg.substr(0, arg.find('=')) << ": '" << text << "', expected " << min
+                  << " to " << max << "\n";
+        return false;
     }
-};
+    out = value;
+    return true;
+}
 
-class App {
-    Hive hive_;
-    Winnie winnie_;
+int main(int argc, char **argv) {
+    std::ofstream binary_log_file;
+    std::string_view log_backend = "async";
+    OverflowPolicy log_overflow = OverflowPolicy::kBlock;
+    std::size_t log_flush_records = 4096;
+    std::int64_t log_flush_ms = 50;
+    std::string log_file_path;
+    std::size_t log_segment_mb = 64;
+    std::ofstream event_file;
+    std::ofstream trace_file;
+    std::string metrics_file;
+    int metrics_port = 0;
+    std::chrono::milliseconds metrics_interval{1000};
+    EventFormat event_format = EventFormat::kJsonLines;
+    std::string_view engine = "threads";
+    int num_bees = 10;
+    int num_workers = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    int num_hives = num_workers;
+    bool pin = false;
+    std::chrono::milliseconds duration = 15s;
+    Simulation::ReturnScan return_scan = Simulation::ReturnScan::kEventQueue;
+    bool auto_release_batch = false;
+    int release_batch = 1;
+    HiveTimes times;
+    std::string hunt_spec, release_spec;
+    bool bench_hive = false, engine_set = false, bees_set = false, duration_set = false;
+    HiveBenchConfig bench_config;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--bench=queue") {
+            RunQueueBenchmark();
+            ReportLockProfiles();
+            return 0;
+        } else if (arg == "--bench=sweep") {
+            RunSweepBenchmark(10'000'000, 100);
+            return 0;
+        } else if (arg == "--bench=wake") {
+            RunWakeBenchmark();
+            return 0;
+        } else if (arg == "--bench=hive") {
+            bench_hive = true;
+        } else if (arg.rfind("--baseline=", 0) == 0) {
+            bench_config.baseline_ = arg.substr(11);
+        } else if (arg.rfind("--regression-pct=", 0) == 0) {
+            if (!ParseNumberOption(arg, bench_config.regression_pct_, 0, 1000)) {
+                return 1;
+            }
+        } else if (arg == "--bench=rng") {
+            RunRngBenchmark(100'000, 100);
+            return 0;
+        } else if (arg.rfind("--decode=", 0) == 0) {
+            std::ifstream in{std::string{arg.substr(9)}, std::ios::binary};
+            if (!DecodeBinaryLog(in, std::cout)) {
+                std::cerr << "Malformed binary log: " << arg.substr(9) << "\n";
+                return 1;
+            }
+            return 0;
+        } else if (arg.rfind("--binary-log=", 0) == 0) {
+            binary_log_file.open(std::string{arg.substr(13)}, std::ios::binary);
+        } else if (arg.rfind("--log-file=", 0) == 0) {
+            log_file_path = arg.substr(11);
+        } else if (arg.rfind("--log-segment-mb=", 0) == 0) {
+            if (!ParseNumberOption(arg, log_segment_mb, 1, kMaxLogSegmentMb)) {
+                return 1;
+            }
+        } else if (arg.rfind("--engine=", 0) == 0) {
+            engine = arg.substr(9);
+            engine_set = true;
+        } else if (arg.rfind("--bees=", 0) == 0) {
+            if (!ParseNumberOption(arg, num_bees, 1)) {
+                return 1;
+            }
+            bees_set = true;
+        } else if (arg.rfind("--workers=", 0) == 0) {
+            if (!ParseNumberOption(arg, num_workers, 1)) {
+                return 1;
+            }
+        } else if (arg.rfind("--hunt-time=", 0) == 0 || arg.rfind("--release-time=", 0) == 0) {
+            std::string_view spec = arg.substr(arg.find('=') + 1);
+            auto distribution = TimeDistribution::Parse(spec);
+            if (!distribution) {
+                std::cerr << "Bad time distribution: " << spec << "\n";
+                return 1;
+            }
+            (arg[2] == 'h' ? times.hunt_ : times.release_) = std::move(*distribution);
+            (arg[2] == 'h' ? hunt_spec : release_spec) = spec;
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            if (!ParseNumberOption(arg, rng_seed)) {
+                return 1;
+            }
+        } else if (arg == "--pin") {
+            pin = true;
+        } else if (arg.rfind("--hives=", 0) == 0) {
+            if (!ParseNumberOption(arg, num_hives, 1)) {
+                return 1;
+            }
+        } else if (arg.rfind("--duration-ms=", 0) == 0) {
+            std::int64_t ms = 0;
+            if (!ParseNumberOption(arg, ms, 0)) {
+                return 1;
+            }
+            duration = std::chrono::milliseconds{ms};
+            duration_set = true;
+        } else if (arg.rfind("--release-batch=", 0) == 0) {
+            auto_release_batch = arg.substr(16) == "auto";
+            if (!auto_release_batch && !ParseNumberOption(arg, release_batch, 1)) {
+                return 1;
+            }
+        } else if (arg == "--sim-returns=queue") {
+            return_scan = Simulation::ReturnScan::kEventQueue;
+        } else if (arg == "--sim-returns=sweep") {
+            return_scan = Simulation::ReturnScan::kSweep;
+        } else if (arg.rfind("--events=", 0) == 0) {
+            event_file.open(std::string{arg.substr(9)});
+        } else if (arg.rfind("--metrics-file=", 0) == 0) {
+            metrics_file = arg.substr(15);
+        } else if (arg.rfind("--metrics-port=", 0) == 0) {
+            if (!ParseNumberOption(arg, metrics_port, 1, 65535)) {
+                return 1;
+            }
+        } else if (arg.rfind("--metrics-interval-ms=", 0) == 0) {
+            std::int64_t ms = 0;
+            if (!ParseNumberOption(arg, ms, 1)) {
+                return 1;
+            }
+            metrics_interval = std::chrono::milliseconds{ms};
+        } else if (arg.rfind("--trace=", 0) == 0) {
+            trace_file.open(std::string{arg.substr(8)});
+        } else if (arg == "--events-format=jsonl") {
+            event_format = EventFormat::kJsonLines;
+        } else if (arg == "--events-format=csv") {
+            event_format = EventFormat::kCsv;
+        } else if (arg.rfind("--log-backend=", 0) == 0) {
+            log_backend = arg.substr(14);
+        } else if (arg.rfind("--log-flush-records=", 0) == 0) {
+            if (!ParseNumberOption(arg, log_flush_records, 1, 65536)) {
+                return 1;
+            }
+        } else if (arg.rfind("--log-flush-ms=", 0) == 0) {
+            if (!ParseNumberOption(arg, log_flush_ms, 1, 60'000)) {
+                return 1;
+            }
+        } else if (arg == "--log-overflow=block") {
+            log_overflow = OverflowPolicy::kBlock;
+        } else if (arg == "--log-overflow=drop-newest") {
+            log_overflow = OverflowPolicy::kDropNewest;
+        } else if (arg == "--log-overflow=drop-oldest") {
+            log_overflow = OverflowPolicy::kDropOldest;
+        } else {
+            std::cerr << "Unknown option: " << arg << "\n";
+            return 1;
+        }
+    }
 
-public:
-    App(int max_bee_count)
-            : hive_(max_bee_count), winnie_(&hive_) {}
+    // The simulation's clock is bounded (Simulation::kMaxTime); the benchmark runs it
+    // kSimBenchTimeScale times the duration.
+    bool runs_sim = bench_hive ? !engine_set || engine == "sim" : engine == "sim";
+    auto max_duration = bench_hive ? Simulation::kMaxTime / kSimBenchTimeScale : Simulation::kMaxTime;
+    if (runs_sim && duration > max_duration) {
+        std::cerr << "--duration-ms must be between 0 and " << max_duration.count() << " for the sim engine\n";
+        return 1;
+    }
 
-    void Start() {
-        hive_.Start();
-        winnie_.Start();
+    if (bench_hive) {
+        if (engine_set) {
+            bench_config.engines_ = {engine};
+        }
+        if (bees_set) {
+            bench_config.bees_ = {num_bees};
+            bench_config.max_threaded_bees_ = num_bees;
+        }
+        if (duration_set) {
+            bench_config.duration_ = duration;
+        }
+        if (hunt_spec.empty() && release_spec.empty()) {
+            for (std::string spec: {"exponential:1000", "lognormal:900:0.5"}) {
+                bench_config.distributions_.emplace_back(spec, HiveTimes{*TimeDistribution::Parse(spec)});
+            }
+            bench_config.distributions_.emplace(bench_config.distributions_.begin(), "uniform:800:1200", HiveTimes{});
+        } else {
+            std::string label = hunt_spec.empty() ? "uniform:800:1200" : hunt_spec;
+            if (!release_spec.empty()) {
+                label += "/" + release_spec;
+            }
+            bench_config.distributions_.emplace_back(label, times);
+        }
+        bench_config.workers_ = num_workers;
+        bench_config.hives_ = num_hives;
+        return RunHiveBenchmark(bench_config);
     }
 
-    void End() {
-        sync_log("Shutting down the application\n");
-        hive_.End();
-        winnie_.End();
+    std::unique_ptr<MappedLogFile> log_file;
+    std::unique_ptr<std::ostream> log_file_stream;
+    if (!log_file_path.empty()) {
+        log_file = std::make_unique<MappedLogFile>(log_file_path, log_segment_mb << 20);
+        log_file_stream = std::make_unique<std::ostream>(log_file.get());
+        sync_logger.Redirect(*log_file_stream);
+    }
+
+    if (event_file.is_open()) {
+        event_stream.Start(event_file, event_format, 1 << 16);
+    }
+    if (trace_file.is_open()) {
+        trace_recorder.Start();
+    }
+    std::unique_ptr<MetricsExporter> metrics_exporter;
+    if (!metrics_file.empty() || metrics_port != 0) {
+        metrics_exporter = std::make_unique<MetricsExporter>(metrics_file, metrics_port, metrics_interval);
+    }
+
+    if (binary_log_file.is_open()) {
+        sync_logger.StartBinary(binary_log_file, 4096, log_overflow);
+    } else if (log_backend == "async") {
+        sync_logger.StartAsync(4096, log_overflow);
+    } else if (log_backend == "buffered") {
+        sync_logger.StartBuffered(log_flush_records, std::chrono::milliseconds{log_flush_ms});
+    } else if (log_backend != "sync") {
+        std::cerr << "Unknown log backend: " << log_backend << "\n";
+        return 1;
+    }
+    // Colony hives release in parallel, so each one only needs its share of the batch.
+    int batch_bees = engine == "colony" ? num_bees / std::max(1, num_hives) : num_bees;
+    if (auto_release_batch) {
+        release_batch = Hive::AutoReleaseBatch(batch_bees, times);
     }
-};
 
-int main() {
-    App app{10};
-    app.Start();
-    std::this_thread::sleep_for(15s);
-    app.End();
+    if (pin && engine != "colony") {
+        // One hive: keep it, its bees and everything they allocate on the first node.
+        PinThisThread(CpuTopology::Detect().CpusOf(0));
+    }
+
+    if (engine == "threads") {
+        App app{num_bees, release_batch, times};
+        app.Start();
+        metrics_registry.SetGaugeSource([&app]() { return app.Gauges(); });
+        std::this_thread::sleep_for(duration);
+        metrics_registry.SetGaugeSource({});
+        app.End();
+    } else if (engine == "coro") {
+        CoroScheduler scheduler{num_workers};
+        CoroHive hive{&scheduler, num_bees, release_batch, times};
+        hive.Start();
+        metrics_registry.SetGaugeSource([&hive]() { return hive.Gauges(); });
+        std::this_thread::sleep_for(duration);
+        metrics_registry.SetGaugeSource({});
+        hive.End();
+    } else if (engine == "colony") {
+        Colony colony{num_bees, num_hives, release_batch, pin, times};
+        colony.Start();
+        metrics_registry.SetGaugeSource([&colony]() { return colony.Gauges(); });
+        std::this_thread::sleep_for(duration);
+        metrics_registry.SetGaugeSource({});
+        colony.End();
+    } else if (engine == "sim") {
+        auto started = std::chrono::steady_clock::now();
+        HiveStats stats = Simulation{num_bees, return_scan, release_batch, times}.Run(duration);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+        SYNC_LOG(kInfo, "Simulated ", duration.count(), "ms of hive time in ", elapsed.count(), "ms\n");
+        SYNC_LOG(kInfo, "Releases: ", stats.releases_, ", returns: ", stats.returns_, ", attacks: ", stats.attacks_,
+                 " (", stats.successful_attacks_, " successful), cures: ", stats.cures_, "\n");
+    } else {
+        std::cerr << "Unknown engine: " << engine << "\n";
+        return 1;
+    }
+    metrics_exporter.reset();
+    if (trace_file.is_open()) {
+        trace_recorder.Stop();
+        trace_recorder.Write(trace_file);
+    }
+    ReportLockProfiles();
+    event_stream.Stop();
+    sync_logger.StopAsync();
+    sync_logger.Redirect(std::cout);
     return 0;
 }
\ No newline at end of file